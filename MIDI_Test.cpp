@@ -1,5 +1,16 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "Gamma/Analysis.h"
@@ -16,11 +27,12 @@
 
 #include "al/graphics/al_Shapes.hpp"
 #include "al/graphics/al_Font.hpp"
+#include "al/graphics/al_EasyFBO.hpp"
 
 #include "al/io/al_MIDI.hpp"
 
-float keyWidth, keyHeight;
-float keyPadding = 2.f;
+#include "SineEnv.hpp"
+#include "SynthCommon.hpp"
 
 int screenWidth, screenHeight;
 
@@ -143,89 +155,286 @@ public:
     }
 };
 
-class SineEnv : public SynthVoice
+// One NOTE_ON to onset measurement, split into where the time went:
+//  queueing  - arrival in midiCallback until the render callback that picks
+//              the trigger up starts
+//  alignment - from the start of that block until the onset is detected in
+//              the rendered audio (includes blocks spent in the attack)
+//  buffer    - one output buffer of playout before the block reaches the DAC
+struct LatencySample
 {
-public:
-    // Unit generators
-    gam::Pan<> mPan;
-    gam::Sine<> mOsc;
-    gam::Env<6> mAmpEnv;
-    // envelope follower to connect audio output to graphics
-    gam::EnvFollow<> mEnvFollow;
+    double queueing = 0;
+    double alignment = 0;
+    double buffer = 0;
+
+    double total() const { return queueing + alignment + buffer; }
+};
 
-    // Initialize voice. This function will only be called once per voice when
-    // it is created. Voices will be reused if they are idle.
-    void init() override
+struct LatencyStats
+{
+    double min = 0, median = 0, p99 = 0;
+
+    static LatencyStats of(std::vector<double> values)
     {
-        // Intialize envelope
-        mAmpEnv.curve(0); // make segments lines
-        mAmpEnv.levels(0, 1, 1, 0);
-        mAmpEnv.sustainPoint(2); // Make point 2 sustain until a release is issued
+        LatencyStats stats;
+        if (values.empty())
+            return stats;
+        std::sort(values.begin(), values.end());
+        stats.min = values.front();
+        stats.median = values[values.size() / 2];
+        stats.p99 = values[std::min(values.size() - 1, (size_t)(values.size() * 0.99))];
+        return stats;
+    }
+};
 
-        createInternalTriggerParameter("amplitude", 0.3, 0.0, 1.0);
-        createInternalTriggerParameter("frequency", 60, 20, 5000);
-        createInternalTriggerParameter("attackTime", 0.0, 0.01, 3.0);
-        createInternalTriggerParameter("releaseTime", 0.4, 0.1, 10.0);
-        createInternalTriggerParameter("pan", 0.0, -1.0, 1.0);
+// Matches timestamped NOTE_ON events against onsets detected in the output of
+// onSound. noteOn() is called from the MIDI thread, blockBegin()/blockEnd()
+// from the audio thread and collect() from the GUI thread. All times are in
+// seconds on the same clock, which lets the offline harness drive it with a
+// simulated clock instead of the real one. Several events can be in flight,
+// so the notes of a chord are each stamped against the block that picked
+// them up, and the first onset after that block completes all of them.
+class LatencyProbe
+{
+public:
+    // Absolute level an onset has to cross, and how far above the level of
+    // the previous block it has to rise when other notes are sounding
+    float threshold = 0.001f;
+    float riseFactor = 1.5f;
+    // Events whose onset is not found within this time are dropped. Longer
+    // than any attack, short enough that a note lost in a sounding chord is
+    // not matched with the onset of the next one.
+    double timeout = 0.05;
+
+    static constexpr int MAX_IN_FLIGHT = 64;
+
+    void noteOn(double arrival)
+    {
+        pending.push(arrival);
     }
 
-    // The audio processing function
-    void onProcess(AudioIOData &io) override
+    void blockBegin(double time)
     {
-        // Get the values from the parameters and apply them to the corresponding
-        // unit generators. You could place these lines in the onTrigger() function,
-        // but placing them here allows for realtime prototyping on a running
-        // voice, rather than having to trigger a new voice to hear the changes.
-        // Parameters will update values once per audio callback because they
-        // are outside the sample processing loop.
-        mOsc.freq(getInternalParameterValue("frequency"));
-        mAmpEnv.lengths()[0] = getInternalParameterValue("attackTime");
-        mAmpEnv.lengths()[2] = getInternalParameterValue("releaseTime");
-        mPan.pos(getInternalParameterValue("pan"));
-        while (io())
+        // Triggers arriving before this callback are rendered in it
+        double arrival;
+        while (pending.peek(arrival) && arrival <= time)
         {
-            float s1 = mOsc() * mAmpEnv() * getInternalParameterValue("amplitude");
-            float s2;
-            mEnvFollow(s1);
-            mPan(s1, s1, s2);
-            io.out(0) += s1;
-            io.out(1) += s2;
+            pending.pop(arrival);
+            if (numInFlight == MAX_IN_FLIGHT)
+            {
+                missed.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            Flight &flight = inFlight[numInFlight++];
+            flight.arrival = arrival;
+            flight.blockStart = time;
+            flight.blocks = 0;
         }
-        // We need to let the synth know that this voice is done
-        // by calling the free(). This takes the voice out of the
-        // rendering chain
-        if (mAmpEnv.done() && (mEnvFollow.value() < 0.001f))
-            free();
     }
 
-    void onProcess(Graphics &g) override
+    void blockEnd(AudioIOData &io)
     {
+        unsigned frames = io.framesPerBuffer();
+        unsigned channels = io.channelsOut();
+        double sr = io.framesPerSecond();
+
+        // A note panned or spatialized away from channel 0 still counts, so
+        // every frame is judged by its loudest channel
+        float level = std::max(threshold, floorLevel * riseFactor);
+        float peak = 0.f;
+        int onset = -1;
+        for (unsigned c = 0; c < channels; c++)
+        {
+            const float *out = io.outBuffer(c);
+            unsigned end = onset < 0 ? frames : unsigned(onset);
+            for (unsigned i = 0; i < frames; i++)
+            {
+                float a = std::fabs(out[i]);
+                if (i < end && a > level)
+                {
+                    onset = i;
+                    end = i;
+                }
+                peak = std::max(peak, a);
+            }
+        }
 
+        int kept = 0;
+        for (int f = 0; f < numInFlight; f++)
+        {
+            Flight &flight = inFlight[f];
+            if (onset >= 0)
+            {
+                LatencySample sample;
+                sample.queueing = flight.blockStart - flight.arrival;
+                sample.alignment = (flight.blocks * frames + onset) / sr;
+                sample.buffer = frames / sr;
+                results.push(sample);
+            }
+            else if (++flight.blocks * frames > timeout * sr)
+            {
+                missed.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                inFlight[kept++] = flight;
+            }
+        }
+        numInFlight = kept;
+        floorLevel = peak;
     }
 
-    // The triggering functions just need to tell the envelope to start or release
-    // The audio processing function checks when the envelope is done to remove
-    // the voice from the processing chain.
-    void onTriggerOn() override
+    // Moves finished measurements into the caller's history
+    void collect(std::vector<LatencySample> &history)
     {
-        mAmpEnv.reset();
+        LatencySample sample;
+        while (results.pop(sample))
+            history.push_back(sample);
     }
 
-    void onTriggerOff() override
+    int missedCount() const { return missed.load(std::memory_order_relaxed); }
+
+private:
+    struct Flight
+    {
+        double arrival;
+        double blockStart;
+        int blocks;
+    };
+
+    SpscQueue<double, 256> pending;
+    SpscQueue<LatencySample, 1024> results;
+    std::atomic<int> missed{0};
+
+    Flight inFlight[MAX_IN_FLIGHT];
+    int numInFlight = 0;
+    float floorLevel = 0.f;
+};
+
+void printLatencyReport(const std::vector<LatencySample> &history, int missed)
+{
+    std::vector<double> q, a, b, t;
+    for (auto &s : history)
+    {
+        q.push_back(s.queueing);
+        a.push_back(s.alignment);
+        b.push_back(s.buffer);
+        t.push_back(s.total());
+    }
+    printf("  %zu events, %d missed (ms: min / median / p99)\n", history.size(), missed);
+    const char *names[] = {"queueing", "alignment", "buffer", "total"};
+    std::vector<double> *columns[] = {&q, &a, &b, &t};
+    for (int i = 0; i < 4; i++)
     {
-        mAmpEnv.release();
+        LatencyStats s = LatencyStats::of(*columns[i]);
+        printf("  %-10s %7.2f %7.2f %7.2f\n", names[i], s.min * 1000, s.median * 1000, s.p99 * 1000);
     }
+}
+
+// Quality-of-service governor for the audio callback. It watches the render
+// time of every block and, while blocks get close to their deadline, sheds
+// work one level at a time:
+//   1 - cap polyphony, stealing the quietest voices
+//   2 - lower the polyphony cap
+//   3 - switch voices to the cheaper recursive oscillator
+//   4 - update voice parameters every few blocks only
+// Quality is restored one level at a time once the load has stayed low.
+// update() runs on the audio thread, the counters are read by the GUI.
+class QosGovernor
+{
+public:
+    static constexpr int NUM_LEVELS = 5;
+    int polyphonyCap[NUM_LEVELS] = {1 << 30, 32, 16, 16, 8};
+    float pressureLoad = 0.75f;
+    float relaxLoad = 0.4f;
+    double escalateInterval = 0.05; // seconds between escalations
+    double relaxTime = 1.0;         // seconds of low load before restoring
+
+    std::atomic<int> level{0};
+    std::atomic<int> escalations{0};
+    std::atomic<int> restores{0};
+    std::atomic<int> voicesStolen{0};
+    std::atomic<int> blocksAtLevel[NUM_LEVELS] = {};
+
+    // lastLoad is the fraction of the deadline used by the previous block
+    void update(float lastLoad, double blockTime)
+    {
+        int l = level.load(std::memory_order_relaxed);
+        sinceChange += blockTime;
+        if (lastLoad > pressureLoad)
+        {
+            lowTime = 0;
+            if (l + 1 < NUM_LEVELS && sinceChange > escalateInterval)
+            {
+                l++;
+                escalations.fetch_add(1, std::memory_order_relaxed);
+                sinceChange = 0;
+            }
+        }
+        else if (lastLoad < relaxLoad)
+        {
+            lowTime += blockTime;
+            if (l > 0 && lowTime > relaxTime)
+            {
+                l--;
+                restores.fetch_add(1, std::memory_order_relaxed);
+                lowTime = 0;
+                sinceChange = 0;
+            }
+        }
+        else
+        {
+            lowTime = 0;
+        }
+        level.store(l, std::memory_order_relaxed);
+        blocksAtLevel[l].fetch_add(1, std::memory_order_relaxed);
+        SineEnv::quality.store(l, std::memory_order_relaxed);
+    }
+
+    // Steals the quietest voices until the active count fits the cap of the
+    // current level. Must run on the audio thread, before render.
+    void enforcePolyphony(PolySynth &synth)
+    {
+        int cap = polyphonyCap[level.load(std::memory_order_relaxed)];
+        while (true)
+        {
+            int count = 0;
+            SineEnv *quietest = nullptr;
+            for (SynthVoice *v = synth.getActiveVoices(); v; v = v->next)
+            {
+                SineEnv *voice = static_cast<SineEnv *>(v);
+                if (voice->mStolen)
+                    continue;
+                count++;
+                if (!quietest || voice->level() < quietest->level())
+                    quietest = voice;
+            }
+            if (count <= cap || !quietest)
+                return;
+            quietest->steal();
+            voicesStolen.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    double sinceChange = 0;
+    double lowTime = 0;
 };
 
 struct CallbackData
 {
     SynthGUIManager<SineEnv> *synthManager;
     FloatingNotes *notes;
+    LatencyProbe *latency;
+    RedrawScheduler *redraw;
+    RenderAhead *renderAhead;
 };
 
 void midiCallback(double deltaTime, std::vector<unsigned char> *msg,
                   void *userData)
 {
+    // Stamp before any printing so the measurement starts at arrival
+    double arrival = secondsNow();
     unsigned numBytes = msg->size();
 
     CallbackData *data = static_cast<CallbackData *>(userData);
@@ -234,6 +443,8 @@ void midiCallback(double deltaTime, std::vector<unsigned char> *msg,
 
     if (numBytes > 0)
     {
+        data->redraw->markDirty();
+
         // The first byte is the status byte indicating the message type
         unsigned char status = msg->at(0);
 
@@ -249,24 +460,36 @@ void midiCallback(double deltaTime, std::vector<unsigned char> *msg,
             switch (type)
             {
             case MIDIByte::NOTE_ON:
+            {
                 printf("Note %u, Vel %u \n", msg->at(1), msg->at(2));
+                data->latency->noteOn(arrival);
 
-                synthManager->voice()->setInternalParameterValue(
-                    "frequency", ::pow(2.f, ((msg->at(1)) - 69.f) / 12.f) * 432.f);
-
-                synthManager->triggerOn((int)msg->at(1));
+                // Triggered right away while the synth plays live, on the
+                // audio thread after taking it back from the worker otherwise
+                int note = msg->at(1);
+                data->renderAhead->liveInput([synthManager, note]()
+                {
+                    synthManager->voice()->setInternalParameterValue(
+                        "frequency", ::pow(2.f, (note - 69.f) / 12.f) * 432.f);
+                    synthManager->triggerOn(note);
+                });
 
                 notes->noteDown((int)msg->at(1));
 
                 break;
+            }
 
             case MIDIByte::NOTE_OFF:
+            {
                 printf("Note %u, Vel %u \n", msg->at(1), msg->at(2));
-                synthManager->triggerOff((int)msg->at(1));
+                int note = msg->at(1);
+                data->renderAhead->liveInput([synthManager, note]()
+                                             { synthManager->triggerOff(note); });
 
                 notes->noteUp((int)msg->at(1));
 
                 break;
+            }
 
             case MIDIByte::PITCH_BEND:
                 printf("Value %u",
@@ -314,6 +537,28 @@ public:
 
     CallbackData callbackData;
 
+    LatencyProbe latency;
+    std::vector<LatencySample> latencyHistory;
+
+    CallbackLoadMeter loadMeter;
+    AdaptiveBufferSize adaptiveBuffer;
+    // Opt in from the GUI, each change reopens the device, which is audible
+    bool adaptiveLatency = false;
+
+    QosGovernor governor;
+
+    ProfilerPanel profilerPanel;
+
+    SpectrumAnalyzer analyzer;
+    SpectrumAnalyzer::Frame analyzerFrame;
+
+    RedrawScheduler redraw;
+    // Last rendered scene, shown again on frames that skip the render
+    EasyFBO sceneFbo;
+    int sceneWidth = 0, sceneHeight = 0;
+
+    RenderAhead renderAhead;
+
     // Mesh and variables for drawing piano keys
     Mesh meshKey;
 
@@ -322,20 +567,23 @@ public:
         // Set sampling rate for Gamma objects from app's audio
         gam::sampleRate(audioIO().framesPerSecond());
 
+        // Calibrate the profiler clock before the first block is timed
+        VoiceProfiler::instance().ticksPerSecond();
+
         callbackData.notes = &notes;
         callbackData.synthManager = &synthManager;
+        callbackData.latency = &latency;
+        callbackData.redraw = &redraw;
+        callbackData.renderAhead = &renderAhead;
 
         imguiInit();
 
-        float w = float(width());
-        float h = float(height());
-        screenWidth = width();
-        screenHeight = height();
-        keyWidth = w / 52.f - keyPadding * 2.f;
-        keyHeight = h / 5.f - keyPadding * 2.f;
+        analyzer.start(audioIO().framesPerSecond());
 
-        // Create a mesh that will be drawn as piano keys
-        addRect(meshKey, keyWidth, keyHeight, keyWidth / 2, 140);
+        // Sequence playback is rendered ahead on a worker thread
+        renderAhead.start(audioIO().framesPerSecond(), audioIO().channelsOut(), synthManager);
+
+        layoutKeys(width(), height());
 
         // Check available ports vs. specified
         unsigned portToOpen = 0;
@@ -375,45 +623,359 @@ public:
     // The audio callback function. Called when audio hardware requires data
     void onSound(AudioIOData &io) override
     {
-        synthManager.render(io); // Render audio
+        latency.blockBegin(secondsNow());
+        governor.update(loadMeter.lastLoad.load(std::memory_order_relaxed),
+                        io.framesPerBuffer() / io.framesPerSecond());
+        loadMeter.begin();
+        // Copy sequence playback rendered ahead, or render live when this
+        // thread owns the synth
+        double rewindTo;
+        if (!renderAhead.read(io, rewindTo))
+        {
+            if (rewindTo >= 0.0)
+                synthManager.synthSequencer().setTime(float(rewindTo));
+            governor.enforcePolyphony(synthManager.synth());
+            synthManager.render(io); // Render audio
+            renderAhead.afterLive(io);
+        }
+        loadMeter.end(io.framesPerBuffer(), io.framesPerSecond());
+        latency.blockEnd(io);
+        analyzer.write(io);
     }
 
     void onAnimate(double dt) override
     {
-        // The GUI is prepared here
-        imguiBeginFrame();
-        // Draw a window that contains the synth control panel
-        synthManager.drawSynthControlPanel();
         notes.update(dt);
-        imguiEndFrame();
+        profilerPanel.drainTrace();
+
+        // The scene moves while notes float, voices sound or the analyzer
+        // still shows something
+        analyzer.latest(analyzerFrame);
+        bool animating = !notes.floaters.empty() ||
+                         synthManager.synth().getActiveVoices() != nullptr ||
+                         analyzerShowsSound();
+
+        // The GUI is prepared here, at a reduced rate while nothing changes
+        if (redraw.beginFrame(dt, animating))
+        {
+            imguiBeginFrame();
+            // Draw a window that contains the synth control panel
+            synthManager.drawSynthControlPanel();
+            drawLatencyPanel();
+            drawAudioLoadPanel();
+            profilerPanel.draw(1e6 * audioIO().framesPerBuffer() / audioIO().framesPerSecond());
+            imguiEndFrame();
+            // Keep full rate while a widget is being dragged or edited
+            if (ImGui::IsAnyItemActive())
+            {
+                redraw.markDirty();
+            }
+        }
+
+        if (adaptiveLatency)
+        {
+            unsigned size = adaptiveBuffer.update(dt, loadMeter, audioIO().framesPerBuffer());
+            if (size > 0)
+            {
+                setBufferSize(audioIO(), loadMeter, size);
+            }
+        }
     }
 
     // The graphics callback function.
     void onDraw(Graphics &g) override
     {
-        g.clear();
+        bool resized = sceneWidth != fbWidth() || sceneHeight != fbHeight();
+        if (resized)
+        {
+            sceneWidth = fbWidth();
+            sceneHeight = fbHeight();
+            sceneFbo.init(sceneWidth, sceneHeight);
+        }
+
+        // Render the scene offscreen only when it changed
+        if (resized || redraw.shouldDraw())
+        {
+            g.pushFramebuffer(sceneFbo);
+            g.clear();
+
+            // This example uses only the orthogonal projection for 2D drawing
+            g.camera(Viewpoint::ORTHO_FOR_2D); // Ortho [0:width] x [0:height]
+
+            drawAnalyzer(g);
+            synthManager.render(g);
+            notes.draw(g);
+            g.popFramebuffer();
+        }
+
+        // Show the scene every frame, the back buffer is undefined after a swap
+        g.blending(false);
+        g.quadViewport(sceneFbo.tex());
+
+        // Draw the GUI panels over the scene
+        imguiDraw();
+    }
+
+    // Spectrum bars along the bottom edge with the oscilloscope above them
+    void drawAnalyzer(Graphics &g)
+    {
+        float w = float(width());
+        float h = float(height());
+
+        g.blending(true);
+        g.blendTrans();
+
+        Mesh bars;
+        bars.primitive(Mesh::TRIANGLES);
+        float bandWidth = w / SpectrumAnalyzer::NUM_BANDS;
+        for (int b = 0; b < SpectrumAnalyzer::NUM_BANDS; b++)
+        {
+            float x0 = b * bandWidth, x1 = x0 + bandWidth - 1;
+            float y1 = analyzerFrame.bands[b] * h * 0.15f;
+            bars.vertex(x0, 0);
+            bars.vertex(x1, 0);
+            bars.vertex(x1, y1);
+            bars.vertex(x0, 0);
+            bars.vertex(x1, y1);
+            bars.vertex(x0, y1);
+        }
+        g.color(0.3, 0.6, 1.0, 0.5);
+        g.draw(bars);
+
+        Mesh scope;
+        scope.primitive(Mesh::LINE_STRIP);
+        for (int i = 0; i < SpectrumAnalyzer::SCOPE_SIZE; i++)
+        {
+            float x = i * w / (SpectrumAnalyzer::SCOPE_SIZE - 1);
+            scope.vertex(x, h * 0.2f + analyzerFrame.scope[i] * h * 0.05f);
+        }
+        g.color(0.6, 1.0, 0.6, 0.7);
+        g.draw(scope);
+    }
+
+    bool analyzerShowsSound() const
+    {
+        const float *bands = analyzerFrame.bands;
+        return analyzerFrame.level > 1e-4f ||
+               *std::max_element(bands, bands + SpectrumAnalyzer::NUM_BANDS) > 0.01f;
+    }
+
+    bool onMouseMove(const Mouse &m) override
+    {
+        redraw.markDirty();
+        return true;
+    }
+
+    bool onMouseDown(const Mouse &m) override
+    {
+        redraw.markDirty();
+        return true;
+    }
 
-        // This example uses only the orthogonal projection for 2D drawing
-        g.camera(Viewpoint::ORTHO_FOR_2D); // Ortho [0:width] x [0:height]
+    bool onMouseUp(const Mouse &m) override
+    {
+        redraw.markDirty();
+        return true;
+    }
 
-        // synthManager.render(g);
-        notes.draw(g);
+    bool onMouseDrag(const Mouse &m) override
+    {
+        redraw.markDirty();
+        return true;
+    }
+
+    bool onKeyDown(const Keyboard &k) override
+    {
+        redraw.markDirty();
+        return true;
+    }
+
+    void onResize(int w, int h) override
+    {
+        layoutKeys(w, h);
+        redraw.markDirty();
+    }
+
+    // Fits the piano keys to the window
+    void layoutKeys(int width, int height)
+    {
+        screenWidth = width;
+        screenHeight = height;
+        keyWidth = width / 52.f - keyPadding * 2.f;
+        keyHeight = height / 5.f - keyPadding * 2.f;
+
+        // Create a mesh that will be drawn as piano keys
+        meshKey.reset();
+        addRect(meshKey, keyWidth, keyHeight, keyWidth / 2, 140);
+    }
+
+    void drawLatencyPanel()
+    {
+        latency.collect(latencyHistory);
+
+        ImGui::Begin("MIDI to audio latency");
+        ImGui::Text("%zu events, %d missed", latencyHistory.size(), latency.missedCount());
+        std::vector<double> columns[4];
+        for (auto &s : latencyHistory)
+        {
+            columns[0].push_back(s.queueing);
+            columns[1].push_back(s.alignment);
+            columns[2].push_back(s.buffer);
+            columns[3].push_back(s.total());
+        }
+        const char *names[] = {"queueing", "alignment", "buffer", "total"};
+        for (int i = 0; i < 4; i++)
+        {
+            LatencyStats s = LatencyStats::of(columns[i]);
+            ImGui::Text("%-10s min %6.2f  med %6.2f  p99 %6.2f ms", names[i],
+                        s.min * 1000, s.median * 1000, s.p99 * 1000);
+        }
+        if (ImGui::Button("Reset"))
+        {
+            latencyHistory.clear();
+        }
+        ImGui::End();
+    }
+
+    void drawAudioLoadPanel()
+    {
+        ImGui::Begin("Audio load");
+        drawAudioLoadControls(audioIO(), loadMeter, adaptiveBuffer, adaptiveLatency);
+
+        ImGui::Separator();
+        const char *levelNames[] = {"full", "polyphony cap", "lower cap",
+                                    "cheap oscillator", "slow control rate"};
+        ImGui::Text("Quality: %s", levelNames[governor.level.load()]);
+        ImGui::Text("%d escalations, %d restores, %d voices stolen",
+                    governor.escalations.load(), governor.restores.load(),
+                    governor.voicesStolen.load());
+        for (int i = 0; i < QosGovernor::NUM_LEVELS; i++)
+        {
+            ImGui::Text("  %-18s %d blocks", levelNames[i], governor.blocksAtLevel[i].load());
+        }
+
+        ImGui::Separator();
+        drawRenderAheadControls(renderAhead);
+
+        ImGui::Separator();
+        drawRedrawControls(redraw);
+        ImGui::End();
     }
 
     // Whenever a key is pressed, this function is called
-    void onExit() override {  }
+    void onExit() override
+    {
+        renderAhead.stop();
+        analyzer.stop();
+        latency.collect(latencyHistory);
+        if (!latencyHistory.empty())
+        {
+            printf("MIDI to audio latency:\n");
+            printLatencyReport(latencyHistory, latency.missedCount());
+        }
+    }
 };
 
-int main()
+// Offline stand-in for a MIDI to audio loopback. Notes are injected at random
+// times on a simulated clock and rendered through a headless PolySynth exactly
+// like onSound does, so the report covers the queueing and block alignment
+// introduced by each buffer size without any hardware in the loop.
+void runLatencyHarness(double sampleRate, int channels)
 {
+    const int bufferSizes[] = {64, 128, 256, 512, 1024};
+    const size_t numEvents = 200;
+
+    gam::sampleRate(sampleRate);
+
+    for (int framesPerBuffer : bufferSizes)
+    {
+        PolySynth synth;
+        synth.allocatePolyphony<SineEnv>(16);
+
+        AudioIOData io;
+        io.framesPerSecond(sampleRate);
+        io.framesPerBuffer(framesPerBuffer);
+        io.channels(channels, true);
+
+        LatencyProbe probe;
+
+        // Groups of notes far enough apart that the release of one has
+        // ended before the next starts. Every fourth group is a triad whose
+        // notes arrive 1 ms apart, as they do over a MIDI cable, so chords
+        // span block boundaries.
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<double> jitter(0.5, 0.7);
+        const float triad[] = {440.f, 554.37f, 659.26f};
+        std::vector<double> onTimes;
+        std::vector<float> onFrequencies;
+        double t = 0.05;
+        for (int group = 0; onTimes.size() < numEvents; group++)
+        {
+            int notes = group % 4 == 3 ? 3 : 1;
+            for (int n = 0; n < notes; n++)
+            {
+                onTimes.push_back(t + n * 0.001);
+                onFrequencies.push_back(triad[n]);
+            }
+            t += jitter(rng);
+        }
+
+        size_t nextOn = 0, nextOff = 0;
+        double blockDuration = framesPerBuffer / sampleRate;
+        double end = t + 1.0;
+        for (double blockStart = 0; blockStart < end; blockStart += blockDuration)
+        {
+            // Like the MIDI thread, triggers land in the synth's queue and
+            // are picked up at the start of the next render
+            while (nextOn < onTimes.size() && onTimes[nextOn] <= blockStart)
+            {
+                SineEnv *voice = synth.getVoice<SineEnv>();
+                voice->setInternalParameterValue("frequency", onFrequencies[nextOn]);
+                synth.triggerOn(voice, 0, (int)nextOn);
+                probe.noteOn(onTimes[nextOn]);
+                nextOn++;
+            }
+            while (nextOff < nextOn && onTimes[nextOff] + 0.05 <= blockStart)
+            {
+                synth.triggerOff((int)nextOff);
+                nextOff++;
+            }
+
+            io.zeroOut();
+            io.frame(0);
+            probe.blockBegin(blockStart);
+            synth.render(io);
+            probe.blockEnd(io);
+        }
+
+        std::vector<LatencySample> history;
+        probe.collect(history);
+        printf("Buffer size %d (%.2f ms):\n", framesPerBuffer, blockDuration * 1000);
+        printLatencyReport(history, probe.missedCount());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Measure latency offline instead of starting the app
+    if (argc > 1 && std::string(argv[1]) == "--latency-test")
+    {
+        runLatencyHarness(48000., 2);
+        return 0;
+    }
+
+    // Speaker layout, e.g. --channels=8 --panner=dbap for an 8 speaker ring
+    int channels = parseSpatialArgs(argc, argv);
+
     // Create app instance
     MyApp app;
 
     // Set window size
     app.dimensions(1200, 600);
 
-    // Set up audio
-    app.configureAudio(48000., 512, 2, 0);
+    // Set up audio. The buffer size is only the starting point when the
+    // adaptive buffer size is enabled.
+    app.configureAudio(48000., 512, channels, 0);
     app.start();
     return 0;
 }
@@ -0,0 +1,485 @@
+// Performance budget gate for the SineEnv and Theremin voices. A test program
+// of its own, built next to the two apps, so neither of them carries the
+// allocation hook below.
+//
+// Each voice renders a fixed event script headless and is checked twice:
+//  output - the render is reduced to a signature, the RMS level of every
+//           channel and the zero crossing rate of the mix per window, and
+//           compared within a tolerance with golden/<name>.sig, which is
+//           committed. Small numeric differences between compilers and
+//           platforms stay inside the tolerance, wrong notes, levels or
+//           silence do not.
+//  budget - per block render time and steady state heap allocations are
+//           compared with golden/<name>.budget, which is committed along
+//           with the margin allowed over it. Times are only comparable on
+//           the machine that measured them, so record the budgets on the
+//           CI machine.
+// A missing signature or budget fails the gate, only the update options
+// below create them.
+//
+// Options:
+//  --update-golden          record new signatures from this render
+//  --update-budgets         record new budgets from this render
+//  --margin=0.25            margin stored with budgets being recorded
+//  --level-tolerance=3      allowed level difference in dB
+//  --rate-tolerance=0.1     allowed relative zero crossing rate difference
+//  --runs=5                 timings are the best of several runs
+//  --golden-dir=golden
+// Any other argument selects a script by name. Exits non-zero on failure.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "Gamma/Domain.h"
+#include "al/io/al_AudioIOData.hpp"
+#include "al/io/al_File.hpp"
+#include "al/scene/al_PolySynth.hpp"
+
+#include "SineEnv.hpp"
+#include "SynthCommon.hpp"
+#include "Theremin.hpp"
+
+using namespace al;
+
+// Heap allocations are counted while gAllocationCounting is set
+std::atomic<bool> gAllocationCounting{false};
+std::atomic<uint64_t> gAllocationCount{0};
+
+void *operator new(size_t size) {
+    if (gAllocationCounting.load(std::memory_order_relaxed))
+        gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+struct GateOptions {
+    bool updateGolden = false;
+    bool updateBudgets = false;
+    double margin = 0.25;
+    double levelTolerance = 3.0;
+    double rateTolerance = 0.1;
+    int runs = 5;
+    std::string dir = "golden";
+    std::vector<std::string> only;
+
+    static GateOptions parse(int argc, char *argv[]) {
+        GateOptions options;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--update-golden")
+                options.updateGolden = true;
+            else if (arg == "--update-budgets")
+                options.updateBudgets = true;
+            else if (arg.rfind("--margin=", 0) == 0)
+                options.margin = std::atof(arg.c_str() + 9);
+            else if (arg.rfind("--level-tolerance=", 0) == 0)
+                options.levelTolerance = std::atof(arg.c_str() + 18);
+            else if (arg.rfind("--rate-tolerance=", 0) == 0)
+                options.rateTolerance = std::atof(arg.c_str() + 17);
+            else if (arg.rfind("--runs=", 0) == 0)
+                options.runs = std::max(1, std::atoi(arg.c_str() + 7));
+            else if (arg.rfind("--golden-dir=", 0) == 0)
+                options.dir = arg.substr(13);
+            else
+                options.only.push_back(arg);
+        }
+        return options;
+    }
+
+    bool selected(const std::string &name) const {
+        return only.empty() || std::find(only.begin(), only.end(), name) != only.end();
+    }
+};
+
+// Coarse description of a render that survives platform differences
+struct Signature {
+    static constexpr int WINDOW_BLOCKS = 24;  // 0.256 s at 512 / 48 kHz
+    static constexpr double SILENCE_DB = -60;
+
+    struct Window {
+        std::vector<double> levelDb;  // RMS per channel
+        double crossingRate = 0;      // zero crossings of the mix per second
+    };
+
+    double sampleRate = 0;
+    int framesPerBuffer = 0;
+    int channels = 0;
+    std::vector<Window> windows;
+
+    // output holds the blocks one after the other, channels planar per block
+    static Signature of(const std::vector<float> &output, double sampleRate,
+                        int framesPerBuffer, int channels) {
+        Signature sig;
+        sig.sampleRate = sampleRate;
+        sig.framesPerBuffer = framesPerBuffer;
+        sig.channels = channels;
+        size_t blockSize = size_t(framesPerBuffer) * channels;
+        size_t blocks = output.size() / blockSize;
+        for (size_t first = 0; first + WINDOW_BLOCKS <= blocks; first += WINDOW_BLOCKS) {
+            Window w;
+            std::vector<double> power(channels, 0.0);
+            int crossings = 0;
+            float previous = 0.f;
+            for (size_t b = first; b < first + WINDOW_BLOCKS; b++) {
+                const float *block = &output[b * blockSize];
+                for (int i = 0; i < framesPerBuffer; i++) {
+                    float mix = 0.f;
+                    for (int c = 0; c < channels; c++) {
+                        float s = block[c * framesPerBuffer + i];
+                        power[c] += double(s) * s;
+                        mix += s;
+                    }
+                    if ((mix < 0.f) != (previous < 0.f) && (b > first || i > 0))
+                        crossings++;
+                    previous = mix;
+                }
+            }
+            double frames = double(WINDOW_BLOCKS) * framesPerBuffer;
+            for (int c = 0; c < channels; c++)
+                w.levelDb.push_back(
+                    std::max(-120.0, 10 * std::log10(power[c] / frames + 1e-30)));
+            w.crossingRate = crossings * sampleRate / frames;
+            sig.windows.push_back(w);
+        }
+        return sig;
+    }
+
+    // Text, so changes to the committed signatures read well in a diff
+    bool save(const std::string &path) const {
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+        fprintf(file, "signature 1 %g %d %d %d %d\n", sampleRate, framesPerBuffer, channels,
+                WINDOW_BLOCKS, int(windows.size()));
+        for (const Window &w : windows) {
+            for (double level : w.levelDb)
+                fprintf(file, "%.2f ", level);
+            fprintf(file, "%.1f\n", w.crossingRate);
+        }
+        return fclose(file) == 0;
+    }
+
+    bool load(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "r");
+        if (!file)
+            return false;
+        int version = 0, windowBlocks = 0, count = 0;
+        bool ok = fscanf(file, "signature %d %lf %d %d %d %d", &version, &sampleRate,
+                         &framesPerBuffer, &channels, &windowBlocks, &count) == 6 &&
+                  version == 1 && windowBlocks == WINDOW_BLOCKS && channels > 0 &&
+                  count >= 0;
+        windows.clear();
+        for (int i = 0; ok && i < count; i++) {
+            Window w;
+            w.levelDb.resize(channels);
+            for (int c = 0; ok && c < channels; c++)
+                ok = fscanf(file, "%lf", &w.levelDb[c]) == 1;
+            ok = ok && fscanf(file, "%lf", &w.crossingRate) == 1;
+            windows.push_back(w);
+        }
+        fclose(file);
+        return ok;
+    }
+};
+
+// Render budgets and the relative margin allowed over them
+struct Budget {
+    double medianBlockUs = 0;
+    double p99BlockUs = 0;
+    uint64_t allocations = 0;
+    double margin = 0;
+
+    bool save(const std::string &path) const {
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+        fprintf(file, "budget 2 %.3f %.3f %llu %.2f\n", medianBlockUs, p99BlockUs,
+                (unsigned long long)allocations, margin);
+        return fclose(file) == 0;
+    }
+
+    bool load(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "r");
+        if (!file)
+            return false;
+        int version = 0;
+        unsigned long long count = 0;
+        bool ok = fscanf(file, "budget %d %lf %lf %llu %lf", &version, &medianBlockUs,
+                         &p99BlockUs, &count, &margin) == 5 &&
+                  version == 2 && margin >= 0;
+        allocations = count;
+        fclose(file);
+        return ok;
+    }
+};
+
+int checkOutput(const std::string &name, const GateOptions &options, const Signature &measured) {
+    std::string path = options.dir + "/" + name + ".sig";
+    if (options.updateGolden) {
+        Dir::make(options.dir);
+        if (!measured.save(path)) {
+            printf("%s: could not write %s\n", name.c_str(), path.c_str());
+            return 1;
+        }
+        printf("%s: wrote %s\n", name.c_str(), path.c_str());
+        return 0;
+    }
+
+    Signature golden;
+    if (!golden.load(path)) {
+        printf("%s: FAIL no readable signature at %s, record it with --update-golden\n",
+               name.c_str(), path.c_str());
+        return 1;
+    }
+    if (golden.sampleRate != measured.sampleRate ||
+        golden.framesPerBuffer != measured.framesPerBuffer ||
+        golden.channels != measured.channels ||
+        golden.windows.size() != measured.windows.size()) {
+        printf("%s: FAIL signature does not match this script, regenerate it\n", name.c_str());
+        return 1;
+    }
+
+    int failures = 0;
+    double worstLevel = 0, worstRate = 0;
+    for (size_t i = 0; i < golden.windows.size(); i++) {
+        const Signature::Window &expected = golden.windows[i];
+        const Signature::Window &actual = measured.windows[i];
+        double seconds = i * Signature::WINDOW_BLOCKS * measured.framesPerBuffer /
+                         measured.sampleRate;
+        bool sounding = false;
+        for (int c = 0; c < measured.channels; c++) {
+            double e = expected.levelDb[c], a = actual.levelDb[c];
+            // Both sides below the floor count as the same silence
+            if (e < Signature::SILENCE_DB && a < Signature::SILENCE_DB)
+                continue;
+            sounding = sounding || e >= Signature::SILENCE_DB;
+            double diff = std::fabs(a - e);
+            worstLevel = std::max(worstLevel, diff);
+            if (!(diff <= options.levelTolerance)) {  // also catches NaN
+                printf("%s: FAIL channel %d at %.2f s is %.1f dB, expected %.1f dB\n",
+                       name.c_str(), c, seconds, a, e);
+                failures++;
+            }
+        }
+        if (sounding && expected.crossingRate > 0) {
+            double diff = std::fabs(actual.crossingRate / expected.crossingRate - 1.0);
+            worstRate = std::max(worstRate, diff);
+            if (!(diff <= options.rateTolerance)) {
+                printf("%s: FAIL %.0f zero crossings/s at %.2f s, expected %.0f\n",
+                       name.c_str(), actual.crossingRate, seconds, expected.crossingRate);
+                failures++;
+            }
+        }
+    }
+    printf("%s: output %s (worst level difference %.2f dB, crossing rate %.1f%%)\n",
+           name.c_str(), failures ? "FAILED" : "passed", worstLevel, worstRate * 100);
+    return failures ? 1 : 0;
+}
+
+int checkBudget(const std::string &name, const GateOptions &options, const Budget &measured) {
+    std::string path = options.dir + "/" + name + ".budget";
+    if (options.updateBudgets) {
+        Budget recorded = measured;
+        recorded.margin = options.margin;
+        Dir::make(options.dir);
+        if (!recorded.save(path)) {
+            printf("%s: could not write %s\n", name.c_str(), path.c_str());
+            return 1;
+        }
+        printf("%s: wrote %s\n", name.c_str(), path.c_str());
+        return 0;
+    }
+
+    Budget budget;
+    if (!budget.load(path)) {
+        printf("%s: FAIL no readable budget at %s, record it with --update-budgets\n",
+               name.c_str(), path.c_str());
+        return 1;
+    }
+
+    int failures = 0;
+    double limit = 1.0 + budget.margin;
+    if (measured.medianBlockUs > budget.medianBlockUs * limit) {
+        printf("%s: FAIL median block time %.1f us over budget %.1f us\n", name.c_str(),
+               measured.medianBlockUs, budget.medianBlockUs * limit);
+        failures++;
+    }
+    if (measured.p99BlockUs > budget.p99BlockUs * limit) {
+        printf("%s: FAIL p99 block time %.1f us over budget %.1f us\n", name.c_str(),
+               measured.p99BlockUs, budget.p99BlockUs * limit);
+        failures++;
+    }
+    if (measured.allocations > uint64_t(budget.allocations * limit)) {
+        printf("%s: FAIL %llu allocations over budget %llu\n", name.c_str(),
+               (unsigned long long)measured.allocations,
+               (unsigned long long)(budget.allocations * limit));
+        failures++;
+    }
+    printf("%s: budget %s\n", name.c_str(), failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+// Script must provide a constructor taking the AudioIOData it renders into,
+// int blocks() and void block(AudioIOData &io, int index), which applies the
+// events of that block and renders it.
+template <class Script>
+int runPerfGate(const std::string &name, const GateOptions &options, double sampleRate,
+                int framesPerBuffer, int channels) {
+    if (!options.selected(name))
+        return 0;
+    gam::sampleRate(sampleRate);
+    SpeakerLayout::instance().setup(channels, SpeakerLayout::VBAP);
+
+    std::vector<float> output;
+    std::vector<double> bestBlockUs;
+    uint64_t allocations = 0;
+    for (int run = 0; run < options.runs; run++) {
+        AudioIOData io;
+        io.framesPerSecond(sampleRate);
+        io.framesPerBuffer(framesPerBuffer);
+        io.channels(channels, true);
+        Script script(io);
+        if (run == 0)
+            bestBlockUs.assign(script.blocks(), 1e30);
+
+        uint64_t runAllocations = 0;
+        for (int b = 0; b < script.blocks(); b++) {
+            io.zeroOut();
+            io.frame(0);
+            uint64_t allocationsBefore = gAllocationCount.load();
+            gAllocationCounting = true;
+            double start = secondsNow();
+            script.block(io, b);
+            double us = (secondsNow() - start) * 1e6;
+            gAllocationCounting = false;
+            runAllocations += gAllocationCount.load() - allocationsBefore;
+            bestBlockUs[b] = std::min(bestBlockUs[b], us);
+
+            if (run == 0) {
+                for (int c = 0; c < channels; c++) {
+                    const float *out = io.outBuffer(c);
+                    output.insert(output.end(), out, out + framesPerBuffer);
+                }
+            }
+        }
+        // The first run includes one-time setup, the rest must be steady
+        if (run == 0 || runAllocations < allocations)
+            allocations = runAllocations;
+    }
+
+    std::vector<double> sorted = bestBlockUs;
+    std::sort(sorted.begin(), sorted.end());
+    Budget measured;
+    measured.medianBlockUs = sorted[sorted.size() / 2];
+    measured.p99BlockUs = sorted[std::min(sorted.size() - 1, size_t(sorted.size() * 0.99))];
+    measured.allocations = allocations;
+    printf("%s: median %.1f us, p99 %.1f us per block, %llu allocations\n", name.c_str(),
+           measured.medianBlockUs, measured.p99BlockUs, (unsigned long long)allocations);
+
+    // Both checks always run, so a slow render still reports its output
+    int failures = checkOutput(name, options,
+                               Signature::of(output, sampleRate, framesPerBuffer, channels));
+    failures += checkBudget(name, options, measured);
+    return failures;
+}
+
+// SineEnv event script: a triad, an added octave, a 16 note burst and the
+// releases of all of them
+class SineEnvScript {
+   public:
+    explicit SineEnvScript(AudioIOData &io)
+        : sampleRate(io.framesPerSecond()), framesPerBuffer(io.framesPerBuffer()) {
+        SineEnv::quality = 0;
+        synth.allocatePolyphony<SineEnv>(32);
+
+        for (int note : {60, 64, 67}) {
+            events.push_back({0.0, note, true});
+            events.push_back({1.0, note, false});
+        }
+        events.push_back({0.5, 72, true});
+        events.push_back({2.5, 72, false});
+        for (int i = 0; i < 16; i++) {
+            events.push_back({1.5 + 0.01 * i, 40 + i * 2, true});
+            events.push_back({2.5, 40 + i * 2, false});
+        }
+        std::stable_sort(events.begin(), events.end(),
+                         [](const Event &a, const Event &b) { return a.time < b.time; });
+    }
+
+    int blocks() const { return int(4.0 * sampleRate / framesPerBuffer); }
+
+    void block(AudioIOData &io, int index) {
+        double time = double(index) * framesPerBuffer / sampleRate;
+        while (next < events.size() && events[next].time <= time) {
+            const Event &e = events[next++];
+            if (e.on) {
+                SineEnv *voice = synth.getVoice<SineEnv>();
+                voice->setInternalParameterValue("frequency",
+                                                 ::pow(2.f, (e.note - 69.f) / 12.f) * 432.f);
+                synth.triggerOn(voice, 0, e.note);
+            } else {
+                synth.triggerOff(e.note);
+            }
+        }
+        synth.render(io);
+    }
+
+   private:
+    struct Event {
+        double time;
+        int note;
+        bool on;
+    };
+
+    double sampleRate;
+    int framesPerBuffer;
+    PolySynth synth;
+    std::vector<Event> events;
+    size_t next = 0;
+};
+
+// Theremin event script: a glide like mouse play, first with the plain
+// oscillators and then with a 16 voice unison
+class ThereminScript {
+   public:
+    explicit ThereminScript(AudioIOData &io)
+        : sampleRate(io.framesPerSecond()), framesPerBuffer(io.framesPerBuffer()) {
+        synth.allocatePolyphony<Theremin>(1);
+        voice = synth.getVoice<Theremin>();
+        voice->setInternalParameterValue("amplitude", 0.5);
+        synth.triggerOn(voice, 0, 0);
+    }
+
+    int blocks() const { return int(4.0 * sampleRate / framesPerBuffer); }
+
+    void block(AudioIOData &io, int index) {
+        double time = double(index) * framesPerBuffer / sampleRate;
+        voice->setInternalParameterValue("frequency", 440 + 200 * std::sin(time * 1.3));
+        voice->setInternalParameterValue("unisonVoices", time < 2.0 ? 1 : 16);
+        synth.render(io);
+    }
+
+   private:
+    double sampleRate;
+    int framesPerBuffer;
+    PolySynth synth;
+    Theremin *voice;
+};
+
+int main(int argc, char *argv[]) {
+    GateOptions options = GateOptions::parse(argc, argv);
+    int failures = runPerfGate<SineEnvScript>("SineEnv", options, 48000., 512, 2);
+    failures += runPerfGate<ThereminScript>("Theremin", options, 48000., 512, 2);
+    return failures ? 1 : 0;
+}
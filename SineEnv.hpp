@@ -0,0 +1,200 @@
+#ifndef SINE_ENV_HPP
+#define SINE_ENV_HPP
+
+// SineEnv voice of MIDI_Test, in its own header so the performance gate can
+// render it without the app.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "Gamma/Analysis.h"
+#include "Gamma/Envelope.h"
+#include "Gamma/Oscillator.h"
+
+#include "al/graphics/al_Shapes.hpp"
+#include "al/scene/al_PolySynth.hpp"
+
+#include "SynthCommon.hpp"
+
+// Piano key geometry, set by the app when the window is resized
+inline float keyWidth, keyHeight;
+inline float keyPadding = 2.f;
+
+class SineEnv : public al::SynthVoice
+{
+public:
+    // Quality level set by the QoS governor from the audio thread before
+    // each render. Higher levels trade sound quality for render time.
+    static inline std::atomic<int> quality{0};
+    static constexpr int CHEAP_OSC_LEVEL = 3;
+    static constexpr int SLOW_CONTROL_LEVEL = 4;
+    static constexpr int SLOW_CONTROL_INTERVAL = 4; // blocks between updates
+
+    // Unit generators
+    SpatialPanner mPan;
+    gam::Sine<> mOsc;
+    // Recursive sine, cheaper than mOsc, used under load
+    gam::SineR<> mOscCheap;
+    gam::Env<6> mAmpEnv;
+    // envelope follower to connect audio output to graphics
+    gam::EnvFollow<> mEnvFollow;
+
+    al::Mesh mMesh;
+
+    // Parameter values cached at control rate
+    float mFrequency = 0.f;
+    float mAmplitude = 0.f;
+    int mControlCountdown = 0;
+    bool mCheap = false;
+    bool mStolen = false;
+
+    static constexpr int CHUNK_SIZE = 256;
+    float mBuffer[CHUNK_SIZE];
+    VoiceProfile mProfile;
+
+    // Initialize voice. This function will only be called once per voice when
+    // it is created. Voices will be reused if they are idle.
+    void init() override
+    {
+        // Intialize envelope
+        mAmpEnv.curve(0); // make segments lines
+        mAmpEnv.levels(0, 1, 1, 0);
+        mAmpEnv.sustainPoint(2); // Make point 2 sustain until a release is issued
+
+        al::addRect(mMesh, 1, 1, 0.5, 0.5);
+
+        createInternalTriggerParameter("amplitude", 0.3, 0.0, 1.0);
+        createInternalTriggerParameter("frequency", 60, 20, 5000);
+        createInternalTriggerParameter("attackTime", 0.0, 0.01, 3.0);
+        createInternalTriggerParameter("releaseTime", 0.4, 0.1, 10.0);
+        createInternalTriggerParameter("pan", 0.0, -1.0, 1.0);
+    }
+
+    // The audio processing function
+    void onProcess(al::AudioIOData &io) override
+    {
+        PROFILE_VOICE_BEGIN(mProfile);
+        int level = quality.load(std::memory_order_relaxed);
+
+        // Get the values from the parameters and apply them to the corresponding
+        // unit generators. You could place these lines in the onTrigger() function,
+        // but placing them here allows for realtime prototyping on a running
+        // voice, rather than having to trigger a new voice to hear the changes.
+        // Parameters will update values once per audio callback because they
+        // are outside the sample processing loop. Under heavy load they are
+        // only updated every few callbacks.
+        if (level < SLOW_CONTROL_LEVEL || --mControlCountdown <= 0)
+        {
+            mControlCountdown = SLOW_CONTROL_INTERVAL;
+            float frequency = getInternalParameterValue("frequency");
+            if (frequency != mFrequency && mCheap)
+            {
+                mOscCheap.set(frequency, 1.f);
+            }
+            mFrequency = frequency;
+            mAmplitude = getInternalParameterValue("amplitude");
+            mOsc.freq(mFrequency);
+            mAmpEnv.lengths()[0] = getInternalParameterValue("attackTime");
+            if (!mStolen)
+            {
+                mAmpEnv.lengths()[2] = getInternalParameterValue("releaseTime");
+            }
+            mPan.pos(getInternalParameterValue("pan"));
+        }
+
+        bool cheap = level >= CHEAP_OSC_LEVEL;
+        if (cheap && !mCheap)
+        {
+            mOscCheap.set(mFrequency, 1.f);
+        }
+        mCheap = cheap;
+
+        // Render in chunks, one pass per stage, so each stage can be timed
+        // on its own without a timer per sample
+        int first = io.frame() + 1;
+        int frames = int(io.framesPerBuffer()) - first;
+        for (int done = 0; done < frames; done += CHUNK_SIZE)
+        {
+            int n = std::min(CHUNK_SIZE, frames - done);
+            {
+                PROFILE_STAGE(mProfile, STAGE_OSC, id());
+                if (mCheap)
+                {
+                    for (int i = 0; i < n; i++)
+                        mBuffer[i] = mOscCheap();
+                }
+                else
+                {
+                    for (int i = 0; i < n; i++)
+                        mBuffer[i] = mOsc();
+                }
+            }
+            {
+                PROFILE_STAGE(mProfile, STAGE_ENV, id());
+                for (int i = 0; i < n; i++)
+                    mBuffer[i] *= mAmpEnv() * mAmplitude;
+            }
+            {
+                PROFILE_STAGE(mProfile, STAGE_PAN, id());
+                for (int i = 0; i < n; i++)
+                    mEnvFollow(mBuffer[i]);
+                mPan.mix(mBuffer, n, io, first + done);
+            }
+        }
+        io.frame(io.framesPerBuffer());
+
+        // We need to let the synth know that this voice is done
+        // by calling the free(). This takes the voice out of the
+        // rendering chain
+        bool finished = mAmpEnv.done() && (mEnvFollow.value() < 0.001f);
+        PROFILE_VOICE_END(mProfile, id(), !finished);
+        if (finished)
+            free();
+    }
+
+    // Bar over the voice's key that follows its output level
+    void onProcess(al::Graphics &g) override
+    {
+        if (mFrequency <= 0.f)
+            return;
+        float note = 69.f + 12.f * std::log2(mFrequency / 432.f);
+        float x = (keyWidth + keyPadding * 2) * (note - 50) + keyPadding;
+        float level = mEnvFollow.value();
+        g.pushMatrix();
+        g.translate(x, 0);
+        g.scale(keyWidth, level * 400.f);
+        g.color(al::Color(al::HSV(x / 1200, 0.6, 1), std::min(1.f, level * 4.f)));
+        g.draw(mMesh);
+        g.popMatrix();
+    }
+
+    // The triggering functions just need to tell the envelope to start or release
+    // The audio processing function checks when the envelope is done to remove
+    // the voice from the processing chain.
+    void onTriggerOn() override
+    {
+        mStolen = false;
+        mControlCountdown = 0;
+        mAmpEnv.reset();
+        mPan.reset();
+    }
+
+    void onTriggerOff() override
+    {
+        mAmpEnv.release();
+    }
+
+    // Fades the voice out quickly so it can be reused. Called by the QoS
+    // governor from the audio thread.
+    void steal()
+    {
+        mStolen = true;
+        mAmpEnv.lengths()[2] = 0.005f;
+        mAmpEnv.release();
+    }
+
+    float level() const { return mEnvFollow.value(); }
+};
+
+#endif // SINE_ENV_HPP
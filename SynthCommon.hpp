@@ -0,0 +1,1398 @@
+#ifndef SYNTH_COMMON_HPP
+#define SYNTH_COMMON_HPP
+
+// Audio, profiling and GUI helpers shared by the MIDI_Test and Theremin
+// examples. Everything here is independent of the voice being played.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "al/io/al_AudioIO.hpp"
+#include "al/io/al_AudioIOData.hpp"
+#include "al/scene/al_PolySynth.hpp"
+#include "al/ui/al_Imgui.hpp"
+
+inline double secondsNow() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Measures how much of each audio callback's deadline is spent rendering.
+// begin()/end() run on the audio thread, the atomics are read by the GUI.
+class CallbackLoadMeter {
+   public:
+    std::atomic<float> load{0.f};  // smoothed fraction of the deadline
+    std::atomic<float> peak{0.f};  // decaying peak fraction of the deadline
+    std::atomic<float> lastLoad{0.f};
+
+    void begin() { start = secondsNow(); }
+
+    void end(unsigned frames, double sampleRate) {
+        double blockTime = frames / sampleRate;
+        float l = float((secondsNow() - start) / blockTime);
+        lastLoad.store(l, std::memory_order_relaxed);
+        // Time based smoothing so the meter behaves the same at any block size
+        float smoothing = float(1.0 - std::exp(-blockTime / 0.2));
+        float smoothed = load.load(std::memory_order_relaxed);
+        load.store(smoothed + (l - smoothed) * smoothing, std::memory_order_relaxed);
+        float p = peak.load(std::memory_order_relaxed) * float(std::exp(-blockTime / 1.0));
+        peak.store(std::max(p, l), std::memory_order_relaxed);
+    }
+
+    void reset() {
+        load.store(0.f);
+        peak.store(0.f);
+        lastLoad.store(0.f);
+    }
+
+   private:
+    double start = 0;
+};
+
+// Picks the smallest buffer size whose callback load stays under a safety
+// margin of the deadline. Steps up as soon as the peak load crosses
+// upThreshold and only steps down after the load has stayed under
+// downThreshold for holdTime, so it does not oscillate between sizes.
+class AdaptiveBufferSize {
+   public:
+    std::vector<unsigned> sizes = {64, 128, 256, 512, 1024};
+    float upThreshold = 0.6f;
+    float downThreshold = 0.25f;
+    double holdTime = 3.0;
+    // Shorter hold while profiling right after it is enabled
+    double startupHoldTime = 0.3;
+    double startupTime = 3.0;
+
+    int changes = 0;
+
+    // Called once per frame from the GUI thread. Returns the buffer size to
+    // switch to, or 0 to keep the current one.
+    unsigned update(double dt, const CallbackLoadMeter &meter, unsigned current) {
+        elapsed += dt;
+        settle -= dt;
+        if (settle > 0)
+            return 0;  // let the meter fill after a change
+
+        size_t index = 0;
+        while (index + 1 < sizes.size() && sizes[index] < current)
+            index++;
+
+        float peak = meter.peak.load(std::memory_order_relaxed);
+        if (peak > upThreshold && index + 1 < sizes.size()) {
+            lowTime = 0;
+            return changeTo(sizes[index + 1]);
+        }
+
+        lowTime = peak < downThreshold ? lowTime + dt : 0;
+        double hold = elapsed < startupTime ? startupHoldTime : holdTime;
+        if (lowTime > hold && index > 0) {
+            lowTime = 0;
+            return changeTo(sizes[index - 1]);
+        }
+        return 0;
+    }
+
+   private:
+    unsigned changeTo(unsigned size) {
+        changes++;
+        settle = 0.2;
+        return size;
+    }
+
+    double elapsed = 0;
+    double lowTime = 0;
+    double settle = 0;
+};
+
+// Reopens the audio device with a new block size. Must not be called from
+// the audio thread.
+inline void setBufferSize(al::AudioIO &audio, CallbackLoadMeter &meter, unsigned size) {
+    printf("Audio buffer size %u -> %u\n", audio.framesPerBuffer(), size);
+    audio.stop();
+    audio.close();
+    // The callback is stopped, so the meter can be cleared without racing it
+    meter.reset();
+    audio.framesPerBuffer(size);
+    audio.open();
+    audio.start();
+}
+
+// Block size, callback load and the adaptive buffer size toggle, drawn into
+// the current ImGui window.
+inline void drawAudioLoadControls(al::AudioIO &audio, const CallbackLoadMeter &meter,
+                                  const AdaptiveBufferSize &adaptive, bool &adaptiveEnabled) {
+    unsigned frames = audio.framesPerBuffer();
+    ImGui::Text("Buffer %u frames (%.2f ms)", frames, 1000. * frames / audio.framesPerSecond());
+    ImGui::ProgressBar(std::min(1.f, meter.load.load()), 0, 0, "load");
+    ImGui::ProgressBar(std::min(1.f, meter.peak.load()), 0, 0, "peak");
+    ImGui::Checkbox("Adaptive buffer size", &adaptiveEnabled);
+    ImGui::Text("%d size changes", adaptive.changes);
+}
+
+// Lock-free single-producer/single-consumer queue used to hand data between
+// the MIDI, audio and GUI threads without blocking the audio callback.
+template <typename T, int N>
+class SpscQueue {
+   public:
+    bool push(const T &value) {
+        int w = writeIndex.load(std::memory_order_relaxed);
+        int next = (w + 1) % N;
+        if (next == readIndex.load(std::memory_order_acquire))
+            return false;  // full, drop
+        items[w] = value;
+        writeIndex.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value) {
+        int r = readIndex.load(std::memory_order_relaxed);
+        if (r == writeIndex.load(std::memory_order_acquire))
+            return false;
+        value = items[r];
+        readIndex.store((r + 1) % N, std::memory_order_release);
+        return true;
+    }
+
+    bool peek(T &value) const {
+        int r = readIndex.load(std::memory_order_relaxed);
+        if (r == writeIndex.load(std::memory_order_acquire))
+            return false;
+        value = items[r];
+        return true;
+    }
+
+   private:
+    T items[N];
+    std::atomic<int> writeIndex{0};
+    std::atomic<int> readIndex{0};
+};
+
+// Per-voice CPU accounting. Voices time their onProcess and the stages inside
+// it with scoped timers reading the CPU timestamp counter. The ticks of each
+// block are accumulated locally and published to a fixed slot with relaxed
+// atomic stores, so the audio thread never locks. Build with
+// VOICE_PROFILING=0 to compile the timers out.
+#ifndef VOICE_PROFILING
+#define VOICE_PROFILING 1
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PROFILE_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_HAS_TSC 1
+#endif
+
+inline uint64_t profileTicks() {
+#ifdef PROFILE_HAS_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+enum ProfileStage {
+    STAGE_TOTAL,
+    STAGE_OSC,
+    STAGE_ENV,
+    STAGE_FILTER,
+    STAGE_PAN,
+    NUM_STAGES
+};
+
+inline const char *profileStageName(int stage) {
+    const char *names[] = {"total", "osc", "env", "filter", "pan"};
+    return names[stage];
+}
+
+struct TraceEvent {
+    int voiceId;
+    int stage;
+    uint64_t start;
+    uint64_t duration;
+};
+
+class VoiceProfiler {
+   public:
+    static constexpr int MAX_SLOTS = 64;
+
+    // Written by the audio thread only
+    struct Slot {
+        std::atomic<int> voiceId{-1};
+        std::atomic<bool> active{false};
+        std::atomic<uint64_t> blocks{0};
+        std::atomic<uint64_t> ticks[NUM_STAGES] = {};
+    };
+
+    Slot slots[MAX_SLOTS];
+    std::atomic<bool> recording{false};
+    SpscQueue<TraceEvent, 16384> trace;
+
+    static VoiceProfiler &instance() {
+        static VoiceProfiler profiler;
+        return profiler;
+    }
+
+    int acquireSlot() {
+        int slot = nextSlot.fetch_add(1);
+        return slot < MAX_SLOTS ? slot : -1;
+    }
+
+    // Timestamp counter rate, measured against the steady clock since the
+    // first call, which waits until the measurement spans 10 ms. Call once
+    // before audio starts so no block is ever converted with a guessed rate.
+    // Call from the GUI thread.
+    double ticksPerSecond() {
+        if (calibrationTime == 0) {
+            calibrationTicks = profileTicks();
+            calibrationTime = secondsNow();
+        }
+        double elapsed = secondsNow() - calibrationTime;
+        if (elapsed < 0.01)
+            std::this_thread::sleep_for(std::chrono::duration<double>(0.01 - elapsed));
+        uint64_t ticks = profileTicks();
+        return (ticks - calibrationTicks) / (secondsNow() - calibrationTime);
+    }
+
+   private:
+    std::atomic<int> nextSlot{0};
+    uint64_t calibrationTicks = 0;
+    double calibrationTime = 0;
+};
+
+// Ticks of one voice for the current block, published in end()
+struct VoiceProfile {
+    int slot = -2;
+    uint64_t ticks[NUM_STAGES] = {};
+    uint64_t blockStart = 0;
+
+    void begin() {
+        if (slot == -2)
+            slot = VoiceProfiler::instance().acquireSlot();
+        for (int i = 0; i < NUM_STAGES; i++)
+            ticks[i] = 0;
+        blockStart = profileTicks();
+    }
+
+    void add(int stage, uint64_t start, uint64_t end, int voiceId) {
+        ticks[stage] += end - start;
+        VoiceProfiler &profiler = VoiceProfiler::instance();
+        if (profiler.recording.load(std::memory_order_relaxed))
+            profiler.trace.push({voiceId, stage, start, end - start});
+    }
+
+    void end(int voiceId, bool active) {
+        add(STAGE_TOTAL, blockStart, profileTicks(), voiceId);
+        if (slot < 0)
+            return;
+        VoiceProfiler::Slot &s = VoiceProfiler::instance().slots[slot];
+        s.voiceId.store(voiceId, std::memory_order_relaxed);
+        s.active.store(active, std::memory_order_relaxed);
+        for (int i = 0; i < NUM_STAGES; i++) {
+            uint64_t total = s.ticks[i].load(std::memory_order_relaxed);
+            s.ticks[i].store(total + ticks[i], std::memory_order_relaxed);
+        }
+        s.blocks.store(s.blocks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+class ScopedStageTimer {
+   public:
+    ScopedStageTimer(VoiceProfile &profile, int stage, int voiceId)
+        : profile(profile), stage(stage), voiceId(voiceId), start(profileTicks()) {}
+
+    ~ScopedStageTimer() { profile.add(stage, start, profileTicks(), voiceId); }
+
+   private:
+    VoiceProfile &profile;
+    int stage;
+    int voiceId;
+    uint64_t start;
+};
+
+#if VOICE_PROFILING
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_VOICE_BEGIN(profile) (profile).begin()
+#define PROFILE_VOICE_END(profile, id, active) (profile).end(id, active)
+#define PROFILE_STAGE(profile, stage, id) \
+    ScopedStageTimer PROFILE_CONCAT(stageTimer, __LINE__)(profile, stage, id)
+#else
+#define PROFILE_VOICE_BEGIN(profile)
+#define PROFILE_VOICE_END(profile, id, active)
+#define PROFILE_STAGE(profile, stage, id)
+#endif
+
+// GUI side of the voice profiler: per-voice averages since the previous GUI
+// frame and the recorded trace. Runs on the GUI thread only.
+class ProfilerPanel {
+   public:
+    // deadlineUs is the length of one audio block
+    void draw(double deadlineUs) {
+        VoiceProfiler &profiler = VoiceProfiler::instance();
+        double ticksPerUs = profiler.ticksPerSecond() / 1e6;
+
+        ImGui::Begin("Voice profiler");
+        ImGui::Text("Deadline %.0f us per block", deadlineUs);
+        for (int slot = 0; slot < VoiceProfiler::MAX_SLOTS; slot++) {
+            VoiceProfiler::Slot &s = profiler.slots[slot];
+            // Average over the blocks since the previous GUI frame
+            uint64_t blocks = s.blocks.load(std::memory_order_relaxed);
+            uint64_t newBlocks = blocks - blocksSeen[slot];
+            blocksSeen[slot] = blocks;
+            double us[NUM_STAGES];
+            for (int i = 0; i < NUM_STAGES; i++) {
+                uint64_t ticks = s.ticks[i].load(std::memory_order_relaxed);
+                us[i] = newBlocks ? (ticks - ticksSeen[slot][i]) / ticksPerUs / newBlocks : 0;
+                ticksSeen[slot][i] = ticks;
+            }
+            if (!s.active.load(std::memory_order_relaxed) || newBlocks == 0)
+                continue;
+
+            // One bar per stage, as its share of the voice's total
+            ImGui::Text("voice %d: %.1f us (%.1f%%)", s.voiceId.load(), us[STAGE_TOTAL],
+                        100 * us[STAGE_TOTAL] / deadlineUs);
+            for (int i = STAGE_OSC; i < NUM_STAGES; i++) {
+                if (us[i] == 0)
+                    continue;
+                char label[64];
+                snprintf(label, sizeof(label), "%s %.1f us", profileStageName(i), us[i]);
+                ImGui::ProgressBar(float(us[i] / std::max(1e-9, us[STAGE_TOTAL])), 0, 0, label);
+            }
+        }
+
+        ImGui::Separator();
+        bool recording = profiler.recording.load();
+        if (ImGui::Checkbox("Record trace", &recording)) {
+            profiler.recording.store(recording);
+        }
+        ImGui::Text("%zu trace events", traceEvents.size());
+        if (ImGui::Button("Export Chrome trace")) {
+            exportTrace("voice_profile_trace.json", ticksPerUs);
+        }
+        ImGui::End();
+    }
+
+    // Moves recorded events out of the profiler's queue. Call every frame,
+    // independent of the GUI rate, so the queue never fills while recording.
+    void drainTrace() {
+        TraceEvent event;
+        while (VoiceProfiler::instance().trace.pop(event)) {
+            traceEvents.push_back(event);
+        }
+    }
+
+    // Writes the recorded events in the Chrome trace event format, viewable in
+    // chrome://tracing or Perfetto. One thread row per voice.
+    void exportTrace(const char *path, double ticksPerUs) {
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            printf("Could not write %s\n", path);
+            return;
+        }
+        drainTrace();
+        // Events are queued when they end, so the earliest start is not
+        // necessarily the first one, e.g. a voice total is queued after its stages
+        uint64_t origin = UINT64_MAX;
+        for (const TraceEvent &e : traceEvents) {
+            origin = std::min(origin, e.start);
+        }
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < traceEvents.size(); i++) {
+            const TraceEvent &e = traceEvents[i];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    i ? ",\n" : "", profileStageName(e.stage), e.voiceId,
+                    (int64_t)(e.start - origin) / ticksPerUs, e.duration / ticksPerUs);
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        printf("Wrote %zu trace events to %s\n", traceEvents.size(), path);
+        traceEvents.clear();
+    }
+
+   private:
+    uint64_t blocksSeen[VoiceProfiler::MAX_SLOTS] = {};
+    uint64_t ticksSeen[VoiceProfiler::MAX_SLOTS][NUM_STAGES] = {};
+    std::vector<TraceEvent> traceEvents;
+};
+
+// Speaker layout shared by every voice. Gains for every pan position are
+// precomputed into a table when the layout is set up, so a voice only looks
+// up one row per block instead of evaluating the panning law per sample.
+// Set up once from main() before audio starts, read only afterwards.
+class SpeakerLayout {
+   public:
+    enum Method {
+        VBAP,  // pairwise vector base amplitude panning, two speakers active
+        DBAP   // distance based amplitude panning, all speakers active
+    };
+
+    static constexpr int MAX_CHANNELS = 64;
+    static constexpr int TABLE_SIZE = 1024;  // pan positions in the table
+
+    static SpeakerLayout &instance() {
+        static SpeakerLayout layout;
+        return layout;
+    }
+
+    SpeakerLayout() { setup(2, VBAP); }
+
+    // One or two channels use the equal power stereo law with either method.
+    // More channels form a ring of equally spaced speakers, channel 0 in
+    // front and the rest clockwise.
+    void setup(int channels, Method method) {
+        channels = std::max(1, std::min(MAX_CHANNELS, channels));
+        std::vector<float> azimuths;
+        for (int c = 0; c < channels; c++)
+            azimuths.push_back(360.f * c / channels);
+        setup(azimuths, method);
+    }
+
+    // Ring of speakers at arbitrary azimuths in degrees, clockwise from the
+    // front. The index in azimuths is the output channel.
+    void setup(const std::vector<float> &azimuths, Method method) {
+        mChannels = std::max(1, std::min(MAX_CHANNELS, int(azimuths.size())));
+        mMethod = method;
+        mRing = mChannels > 2;
+        // A ring wraps around, stereo has one more row for the right edge
+        int rows = mRing ? TABLE_SIZE : TABLE_SIZE + 1;
+        mGains.assign(size_t(rows) * MAX_CHANNELS, 0.f);
+        mActive.assign(size_t(rows) * MAX_CHANNELS, 0);
+        mNumActive.assign(rows, 0);
+
+        for (int row = 0; row < rows; row++) {
+            float *g = &mGains[size_t(row) * MAX_CHANNELS];
+            float pan = 2.f * row / TABLE_SIZE - 1.f;
+            float azimuth = pan * float(M_PI);  // 0 in front, +-1 behind
+            if (!mRing)
+                stereoGains(pan, g);
+            else if (method == VBAP)
+                vbapGains(azimuths, azimuth, g);
+            else
+                dbapGains(azimuths, azimuth, g);
+            uint8_t *active = &mActive[size_t(row) * MAX_CHANNELS];
+            for (int c = 0; c < mChannels; c++) {
+                if (g[c] != 0.f)
+                    active[mNumActive[row]++] = uint8_t(c);
+            }
+        }
+    }
+
+    // Table row for a pan position from -1 to 1. Positions wrap around a
+    // ring and are clamped in stereo.
+    int row(float pan) const {
+        float x = (pan + 1.f) * 0.5f;
+        if (mRing) {
+            x -= std::floor(x);
+            return int(x * TABLE_SIZE + 0.5f) & (TABLE_SIZE - 1);
+        }
+        x = std::max(0.f, std::min(1.f, x));
+        return int(x * TABLE_SIZE + 0.5f);
+    }
+
+    // MAX_CHANNELS gains, zero for inactive channels
+    const float *gains(int row) const { return &mGains[size_t(row) * MAX_CHANNELS]; }
+    const uint8_t *active(int row) const { return &mActive[size_t(row) * MAX_CHANNELS]; }
+    int numActive(int row) const { return mNumActive[row]; }
+
+    int channels() const { return mChannels; }
+    Method method() const { return mMethod; }
+
+   private:
+    void stereoGains(float pan, float *g) const {
+        if (mChannels == 1) {
+            g[0] = 1.f;
+            return;
+        }
+        float angle = float((pan + 1.f) * M_PI / 4.0);
+        g[0] = std::cos(angle);
+        g[1] = std::sin(angle);
+        // Exact zeros at the extremes keep the other side inactive
+        if (g[0] < 1e-6f)
+            g[0] = 0.f;
+        if (g[1] < 1e-6f)
+            g[1] = 0.f;
+    }
+
+    // Pairwise 2D VBAP between the two speakers adjacent to the source
+    void vbapGains(const std::vector<float> &azimuths, float azimuth, float *g) const {
+        // Speakers sorted by angle, pairs are neighbours on the ring
+        std::vector<int> order(mChannels);
+        for (int c = 0; c < mChannels; c++)
+            order[c] = c;
+        auto angleOf = [&](int c) {
+            float a = azimuths[c] * float(M_PI / 180.0);
+            return a - 2.f * float(M_PI) * std::floor(a / (2.f * float(M_PI)));
+        };
+        std::sort(order.begin(), order.end(),
+                  [&](int a, int b) { return angleOf(a) < angleOf(b); });
+
+        float px = std::sin(azimuth), py = std::cos(azimuth);
+        for (int i = 0; i < mChannels; i++) {
+            int a = order[i], b = order[(i + 1) % mChannels];
+            float ax = std::sin(angleOf(a)), ay = std::cos(angleOf(a));
+            float bx = std::sin(angleOf(b)), by = std::cos(angleOf(b));
+            float det = ax * by - ay * bx;
+            if (std::fabs(det) < 1e-6f)
+                continue;
+            // Solve p = ga * a + gb * b
+            float ga = (px * by - py * bx) / det;
+            float gb = (ax * py - ay * px) / det;
+            if (ga < -1e-6f || gb < -1e-6f)
+                continue;
+            ga = std::max(0.f, ga);
+            gb = std::max(0.f, gb);
+            float norm = 1.f / std::sqrt(ga * ga + gb * gb);
+            g[a] = ga * norm > 1e-6f ? ga * norm : 0.f;
+            g[b] = gb * norm > 1e-6f ? gb * norm : 0.f;
+            return;
+        }
+        // Degenerate layout, fall back to the nearest speaker
+        int nearest = 0;
+        float best = -2.f;
+        for (int c = 0; c < mChannels; c++) {
+            float dot = px * std::sin(angleOf(c)) + py * std::cos(angleOf(c));
+            if (dot > best) {
+                best = dot;
+                nearest = c;
+            }
+        }
+        g[nearest] = 1.f;
+    }
+
+    // DBAP with the speakers on the unit circle and the source just inside
+    // it, 6 dB rolloff per doubling of distance, constant total power
+    void dbapGains(const std::vector<float> &azimuths, float azimuth, float *g) const {
+        const float radius = 0.8f;
+        const float blur = 0.1f;
+        float px = radius * std::sin(azimuth), py = radius * std::cos(azimuth);
+        float power = 0.f;
+        for (int c = 0; c < mChannels; c++) {
+            float a = azimuths[c] * float(M_PI / 180.0);
+            float dx = std::sin(a) - px, dy = std::cos(a) - py;
+            g[c] = 1.f / std::sqrt(dx * dx + dy * dy + blur * blur);
+            power += g[c] * g[c];
+        }
+        float norm = 1.f / std::sqrt(power);
+        for (int c = 0; c < mChannels; c++)
+            g[c] *= norm;
+    }
+
+    int mChannels = 0;
+    Method mMethod = VBAP;
+    bool mRing = false;
+    std::vector<float> mGains;
+    std::vector<uint8_t> mActive;
+    std::vector<int> mNumActive;
+};
+
+// Sets the speaker layout up from the command line, e.g. --channels=8
+// --panner=dbap for an 8 speaker ring. Returns the number of channels.
+inline int parseSpatialArgs(int argc, char *argv[]) {
+    int channels = 2;
+    SpeakerLayout::Method method = SpeakerLayout::VBAP;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--channels=", 0) == 0)
+            channels = std::max(1, std::min(SpeakerLayout::MAX_CHANNELS,
+                                            std::atoi(arg.c_str() + 11)));
+        else if (arg == "--panner=dbap")
+            method = SpeakerLayout::DBAP;
+        else if (arg == "--panner=vbap")
+            method = SpeakerLayout::VBAP;
+    }
+    SpeakerLayout::instance().setup(channels, method);
+    return channels;
+}
+
+// Per voice panner. Mixes a mono block into every active output channel, one
+// tight multiply-add loop per channel that the compiler vectorizes, so the
+// cost per voice depends on the active speakers (two for VBAP) rather than
+// on the size of the array. A position change ramps over one block.
+class SpatialPanner {
+   public:
+    // The next position is taken without a ramp, call when a note starts
+    void reset() { mRow = -1; }
+
+    void pos(float pan) { mTarget = SpeakerLayout::instance().row(pan); }
+
+    void mix(const float *in, int n, al::AudioIOData &io, int offset) {
+        const SpeakerLayout &layout = SpeakerLayout::instance();
+        int channels = std::min(layout.channels(), int(io.channelsOut()));
+        const float *target = layout.gains(mTarget);
+
+        if (mRow != mTarget && mRow >= 0) {
+            // Ramp every channel active at either position
+            float step = 1.f / n;
+            const uint8_t *lists[2] = {layout.active(mRow), layout.active(mTarget)};
+            int counts[2] = {layout.numActive(mRow), layout.numActive(mTarget)};
+            uint64_t mixed = 0;  // channels in both lists are only mixed once
+            for (int l = 0; l < 2; l++) {
+                for (int k = 0; k < counts[l]; k++) {
+                    int c = lists[l][k];
+                    if (c >= channels || ((mixed >> c) & 1))
+                        continue;
+                    mixed |= uint64_t(1) << c;
+                    mixRamp(io.outBuffer(c) + offset, in, mGains[c], target[c], step, n);
+                }
+            }
+        } else {
+            const uint8_t *active = layout.active(mTarget);
+            for (int k = 0; k < layout.numActive(mTarget); k++) {
+                int c = active[k];
+                if (c < channels)
+                    mixGain(io.outBuffer(c) + offset, in, target[c], n);
+            }
+        }
+        if (mRow != mTarget) {
+            std::copy(target, target + SpeakerLayout::MAX_CHANNELS, mGains);
+            mRow = mTarget;
+        }
+    }
+
+   private:
+    static void mixGain(float *__restrict out, const float *__restrict in, float gain, int n) {
+        for (int i = 0; i < n; i++)
+            out[i] += in[i] * gain;
+    }
+
+    static void mixRamp(float *__restrict out, const float *__restrict in, float from,
+                        float to, float step, int n) {
+        float delta = (to - from) * step;
+        for (int i = 0; i < n; i++)
+            out[i] += in[i] * (from + delta * i);
+    }
+
+    int mRow = -1;
+    int mTarget = 0;
+    alignas(64) float mGains[SpeakerLayout::MAX_CHANNELS] = {};
+};
+
+// Spectrum and oscilloscope analyzer that keeps all the work off the audio
+// thread. write() only copies the output block into a lock-free ring. A
+// worker thread takes overlapping windows from the ring, runs a real FFT and
+// bins the magnitudes on a log frequency axis. Results are handed to the
+// draw thread through a triple buffer, so neither side ever waits.
+class SpectrumAnalyzer {
+   public:
+    static constexpr int FFT_SIZE = 2048;
+    static constexpr int HOP_SIZE = FFT_SIZE / 4;  // 75% overlap
+    static constexpr int RING_SIZE = 1 << 16;
+    static constexpr int NUM_BANDS = 96;
+    static constexpr int SCOPE_SIZE = 512;
+
+    struct Frame {
+        float bands[NUM_BANDS] = {};  // 0 to 1, over a 90 dB range
+        float scope[SCOPE_SIZE] = {};
+        float level = 0.f;  // RMS of the last window
+    };
+
+    ~SpectrumAnalyzer() { stop(); }
+
+    void start(double sampleRate) {
+        if (running)
+            return;
+        prepare(sampleRate);
+        running = true;
+        worker = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        running = false;
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // Audio thread. Copies the mono mix of all channels into the ring. Mixes
+    // of more than two channels are scaled to the level of a stereo mix, so
+    // the dB scale does not depend on the size of the speaker array.
+    void write(al::AudioIOData &io) {
+        unsigned frames = io.framesPerBuffer();
+        int channels = io.channelsOut();
+        float scale = channels > 2 ? 2.f / channels : 1.f;
+        uint64_t w = written.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < frames; i++) {
+            float sum = 0.f;
+            for (int c = 0; c < channels; c++)
+                sum += io.outBuffer(c)[i];
+            ring[(w + i) & (RING_SIZE - 1)] = sum * scale;
+        }
+        written.store(w + frames, std::memory_order_release);
+    }
+
+    // Draw thread. Copies the newest frame into out, returns false if
+    // nothing new was published since the last call.
+    bool latest(Frame &out) {
+        if (!(middle.load(std::memory_order_acquire) & FRESH))
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+        out = frames[front];
+        return true;
+    }
+
+   private:
+    static constexpr int FRESH = 4;
+    static constexpr int INDEX_MASK = 3;
+
+    void prepare(double sampleRate) {
+        int half = FFT_SIZE / 2;
+        for (int i = 0; i < FFT_SIZE; i++) {
+            window[i] = float(0.5 - 0.5 * std::cos(2.0 * M_PI * i / FFT_SIZE));
+        }
+        for (int k = 0; k < half; k++) {
+            // Twiddles of the half size complex FFT and of the real unpacking
+            halfCos[k] = float(std::cos(2.0 * M_PI * k / half));
+            halfSin[k] = float(std::sin(2.0 * M_PI * k / half));
+            realCos[k] = float(std::cos(2.0 * M_PI * k / FFT_SIZE));
+            realSin[k] = float(std::sin(2.0 * M_PI * k / FFT_SIZE));
+        }
+        int bits = 0;
+        while ((1 << bits) < half)
+            bits++;
+        for (int i = 0; i < half; i++) {
+            int r = 0;
+            for (int b = 0; b < bits; b++)
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            bitReverse[i] = r;
+        }
+
+        // Log spaced bands from 30 Hz to Nyquist, as fractional bin edges
+        double low = 30.0, high = sampleRate / 2;
+        double binHz = sampleRate / FFT_SIZE;
+        for (int b = 0; b <= NUM_BANDS; b++) {
+            double f = low * std::pow(high / low, double(b) / NUM_BANDS);
+            bandEdges[b] = float(f / binHz);
+        }
+    }
+
+    void run() {
+        uint64_t readPos = written.load(std::memory_order_acquire);
+        while (running) {
+            uint64_t available = written.load(std::memory_order_acquire);
+            // Skip ahead if the worker fell behind the ring
+            if (available - readPos > RING_SIZE - HOP_SIZE)
+                readPos = available - HOP_SIZE;
+            while (available - readPos >= HOP_SIZE) {
+                std::copy(history + HOP_SIZE, history + FFT_SIZE, history);
+                for (int i = 0; i < HOP_SIZE; i++)
+                    history[FFT_SIZE - HOP_SIZE + i] = ring[(readPos + i) & (RING_SIZE - 1)];
+                readPos += HOP_SIZE;
+                analyze();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+
+    void analyze() {
+        int half = FFT_SIZE / 2;
+        // Pack even samples as real and odd samples as imaginary parts
+        float energy = 0.f;
+        for (int i = 0; i < half; i++) {
+            float a = history[2 * i], b = history[2 * i + 1];
+            energy += a * a + b * b;
+            re[bitReverse[i]] = a * window[2 * i];
+            im[bitReverse[i]] = b * window[2 * i + 1];
+        }
+        fftHalf();
+
+        // Unpack the spectrum of the real input. Hann window gain is 0.5.
+        float scale = 4.f / FFT_SIZE;
+        for (int k = 0; k < half; k++) {
+            int m = (half - k) & (half - 1);
+            float er = 0.5f * (re[k] + re[m]), ei = 0.5f * (im[k] - im[m]);
+            float orr = 0.5f * (im[k] + im[m]), oi = -0.5f * (re[k] - re[m]);
+            float xr = er + realCos[k] * orr + realSin[k] * oi;
+            float xi = ei + realCos[k] * oi - realSin[k] * orr;
+            magnitude[k] = std::sqrt(xr * xr + xi * xi) * scale;
+        }
+
+        Frame &frame = frames[back];
+        for (int b = 0; b < NUM_BANDS; b++) {
+            // Peak of the bins in the band, or the nearest bin for bands
+            // narrower than one bin
+            int first = std::min(half - 1, int(bandEdges[b] + 0.5f));
+            int last = std::min(half - 1, std::max(first, int(bandEdges[b + 1])));
+            float peak = 0.f;
+            for (int k = first; k <= last; k++)
+                peak = std::max(peak, magnitude[k]);
+            float db = 20.f * std::log10(peak + 1e-9f);
+            float value = std::max(0.f, std::min(1.f, (db + 90.f) / 90.f));
+            // Fast attack, slow release
+            bands[b] = std::max(value, bands[b] * 0.9f);
+            frame.bands[b] = bands[b];
+        }
+        // Start the scope at the latest rising zero crossing that leaves
+        // SCOPE_SIZE samples, so a steady tone stands still on screen
+        int scopeStart = FFT_SIZE - SCOPE_SIZE;
+        for (int i = scopeStart; i > 0; i--) {
+            if (history[i - 1] < 0.f && history[i] >= 0.f) {
+                scopeStart = i;
+                break;
+            }
+        }
+        std::copy(history + scopeStart, history + scopeStart + SCOPE_SIZE, frame.scope);
+        frame.level = std::sqrt(energy / FFT_SIZE);
+
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // In-place radix-2 FFT of size FFT_SIZE / 2 on split real and imaginary
+    // arrays, inputs already in bit reversed order. The inner loop runs over
+    // contiguous memory so the compiler can vectorize it.
+    void fftHalf() {
+        int half = FFT_SIZE / 2;
+        for (int len = 2; len <= half; len <<= 1) {
+            int step = half / len;
+            int span = len / 2;
+            for (int i = 0; i < half; i += len) {
+                float *ar = re + i, *ai = im + i;
+                float *br = re + i + span, *bi = im + i + span;
+                for (int j = 0; j < span; j++) {
+                    float wr = halfCos[j * step], wi = -halfSin[j * step];
+                    float tr = br[j] * wr - bi[j] * wi;
+                    float ti = br[j] * wi + bi[j] * wr;
+                    br[j] = ar[j] - tr;
+                    bi[j] = ai[j] - ti;
+                    ar[j] += tr;
+                    ai[j] += ti;
+                }
+            }
+        }
+    }
+
+    // Audio thread to worker
+    std::vector<float> ring = std::vector<float>(RING_SIZE);
+    std::atomic<uint64_t> written{0};
+
+    // Worker state
+    std::thread worker;
+    std::atomic<bool> running{false};
+    float history[FFT_SIZE] = {};
+    float window[FFT_SIZE];
+    float re[FFT_SIZE / 2], im[FFT_SIZE / 2];
+    float magnitude[FFT_SIZE / 2];
+    float halfCos[FFT_SIZE / 2], halfSin[FFT_SIZE / 2];
+    float realCos[FFT_SIZE / 2], realSin[FFT_SIZE / 2];
+    int bitReverse[FFT_SIZE / 2];
+    float bandEdges[NUM_BANDS + 1];
+    float bands[NUM_BANDS] = {};
+
+    // Worker to draw thread triple buffer. The worker owns back, the draw
+    // thread owns front, middle is swapped atomically with a fresh flag.
+    Frame frames[3];
+    int back = 0;
+    int front = 2;
+    std::atomic<int> middle{1};
+};
+
+// Renders sequencer playback ahead of the audio callback. While a sequence
+// plays and nobody plays live, a worker thread owns the synth and renders it
+// into a large lock-free ring up to leadSeconds ahead, and the audio callback
+// only copies blocks out, so playback rides out scheduling hiccups that would
+// be xruns with just-in-time rendering. Ownership of the synth moves between
+// the two threads through one atomic state, it is never rendered by both.
+// Voices already sounding when a sequence starts, like a held drone, are live
+// voices: a rewind leaves them alone and the tail never waits for them.
+class RenderAhead {
+   public:
+    enum State {
+        LIVE,     // audio thread renders the synth
+        AHEAD,    // worker renders the synth into the ring
+        DRAIN,    // sequence and its tail are done, audio thread plays out the ring
+        REWIND,   // live input arrived, audio thread takes the synth back
+        HANDOFF,  // audio thread fills the start of the ring, then AHEAD
+        INPUT     // as LIVE while live input is applied on its own thread
+    };
+
+    static constexpr int RING_FRAMES = 1 << 18;  // 5.4 s at 48 kHz
+    static constexpr int BLOCK_SIZE = 512;
+    static constexpr int MAX_LIVE_VOICES = 64;
+    static constexpr int MAX_SEQUENCE_VOICES = 64;
+
+    std::atomic<bool> enabled{true};
+    std::atomic<float> leadSeconds{2.f};
+
+    std::atomic<int> state{LIVE};
+    std::atomic<int> underruns{0};
+    std::atomic<int> fallbacks{0};
+
+    ~RenderAhead() { stop(); }
+
+    // render fills an AudioIOData from synth. It is called by whichever
+    // thread owns the synth.
+    void start(double sampleRate, int channels, al::PolySynth &synth,
+               std::function<void(al::AudioIOData &)> render) {
+        if (running)
+            return;
+        this->sampleRate = sampleRate;
+        this->channels = channels;
+        this->synth = &synth;
+        this->render = render;
+        ring.assign(size_t(RING_FRAMES) * channels, 0.f);
+        scratch.assign(size_t(BLOCK_SIZE) * channels, 0.f);
+        block.framesPerSecond(sampleRate);
+        block.framesPerBuffer(BLOCK_SIZE);
+        block.channels(channels, true);
+        running = true;
+        worker = std::thread([this]() { run(); });
+    }
+
+    // Wires a SynthGUIManager: its synth, its render and its sequencer's
+    // callbacks.
+    template <class Manager>
+    void start(double sampleRate, int channels, Manager &manager) {
+        start(sampleRate, channels, manager.synth(),
+              [&manager](al::AudioIOData &io) { manager.render(io); });
+        manager.synthSequencer().registerSequenceBeginCallback(
+            [this](std::string) { sequenceBegan(); });
+        manager.synthSequencer().registerSequenceEndCallback(
+            [this](std::string) { sequenceEnded(); });
+        manager.synthSequencer().registerTimeChangeCallback(
+            [this](float time) { sequenceTimeChanged(time); }, 0.f);
+    }
+
+    void stop() {
+        running = false;
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // Sequencer callbacks, any thread
+    void sequenceBegan() { pending = true; }
+
+    void sequenceEnded() { ended = true; }
+
+    // Sequence time at the end of the last rendered block
+    void sequenceTimeChanged(float time) { sequenceTime = time; }
+
+    // Any thread but the audio thread, never blocks. Notes played or the
+    // instrument moved by hand need the synth rendered just in time again.
+    // trigger, when given, runs right away on the calling thread while the
+    // audio thread renders live. While the worker or a handoff holds the
+    // synth it is queued instead and run on the audio thread after the
+    // rewind, so the voices it starts count as live. Only one thread may
+    // pass triggers.
+    void liveInput(std::function<void()> trigger = nullptr) {
+        pending = false;
+        int s = LIVE;
+        if (state.compare_exchange_strong(s, INPUT, std::memory_order_acq_rel)) {
+            // No handoff starts while the state is INPUT
+            if (trigger)
+                trigger();
+            state.store(LIVE, std::memory_order_release);
+            return;
+        }
+        if (trigger)
+            liveTriggers.push(trigger);
+        if (s == AHEAD || s == DRAIN || s == HANDOFF)
+            fallback = true;
+    }
+
+    // Audio thread, at the start of each callback. Returns true when the
+    // block was copied from the ring. Otherwise the caller owns the synth and
+    // must render the block live, then call afterLive(). rewindTo is the
+    // audible sequence time the sequencer has to be moved back to first, or
+    // negative when it is already in place.
+    bool read(al::AudioIOData &io, double &rewindTo) {
+        rewindTo = -1.0;
+        int frames = io.framesPerBuffer();
+
+        int s = state.load(std::memory_order_acquire);
+        if (s == LIVE || s == INPUT) {
+            // Input that raced a handoff back is played live anyway
+            fallback = false;
+            applyLiveTriggers();
+            // Once a sequence is waiting for the handoff its first notes
+            // may already be sounding, keep the voices noted before it
+            if (!pending)
+                noteLiveVoices();
+            return false;
+        }
+
+        uint64_t r = readPos.load(std::memory_order_relaxed);
+        uint64_t available = written.load(std::memory_order_acquire) - r;
+        if (s == REWIND) {
+            // The synth runs ahead of what was heard, continue the sequence
+            // from the audible point and fade out the rest of the ring
+            rewindTo = std::max(0.0, sequenceTime.load() - double(available) / sampleRate);
+            fallback = false;
+            fading = true;
+            fallbacks++;
+            stopSequenceVoices(r);
+            applyLiveTriggers();
+            takenBack = true;
+            return false;
+        }
+        if (s == DRAIN && (fallback || available < uint64_t(frames))) {
+            // The sequence is over and the synth only plays what comes in
+            // live from now on, after live input or once the ring runs out
+            // within this block. The rest of the ring is mixed on top, or
+            // faded out when live voices already play in it too.
+            if (fallback)
+                fallbacks++;
+            fallback = false;
+            mixing = synth->getActiveVoices() == nullptr;
+            fading = !mixing;
+            applyLiveTriggers();
+            takenBack = true;
+            return false;
+        }
+
+        int n = int(std::min<uint64_t>(available, frames));
+        for (int c = 0; c < std::min(channels, int(io.channelsOut())); c++) {
+            float *out = io.outBuffer(c);
+            copyFromRing(c, r, out, n);
+            std::fill(out + n, out + frames, 0.f);
+        }
+        readPos.store(r + n, std::memory_order_release);
+        if (n < frames)
+            underruns++;
+        return true;
+    }
+
+    // Audio thread, after a live render. Fades out or mixes in what was
+    // left in the ring after a fallback, publishes LIVE once the synth has
+    // been taken back, and hands the synth to the worker when a sequence
+    // started playing.
+    void afterLive(al::AudioIOData &io) {
+        int frames = io.framesPerBuffer();
+        int outChannels = std::min(channels, int(io.channelsOut()));
+        if (fading || mixing) {
+            uint64_t r = readPos.load(std::memory_order_relaxed);
+            uint64_t available = written.load(std::memory_order_acquire) - r;
+            int n = int(std::min<uint64_t>(available, frames));
+            float step = n > 0 ? 1.f / n : 0.f;
+            for (int c = 0; c < outChannels; c++) {
+                float *out = io.outBuffer(c);
+                for (int i = 0; i < n; i++) {
+                    float ahead = ring[ringIndex(c, r + i)];
+                    if (fading)
+                        out[i] = out[i] * (i * step) + ahead * (1.f - i * step);
+                    else
+                        out[i] += ahead;
+                }
+            }
+            // A fade drops the rest of the ring, it is never heard
+            readPos.store(r + (fading ? available : n), std::memory_order_release);
+            fading = false;
+            mixing = uint64_t(n) < available;
+        }
+        if (takenBack) {
+            takenBack = false;
+            state.store(LIVE, std::memory_order_release);
+        }
+
+        int s = LIVE;
+        if (pending && enabled && !fallback && !mixing &&
+            state.compare_exchange_strong(s, HANDOFF, std::memory_order_acq_rel)) {
+            pending = false;
+            ended = false;
+            tail = false;
+            // The sequence voices sounding now were heard before the ring
+            numSequenceVoices = 0;
+            noteVoiceOnsets(-1);
+            prefill(io);
+            // Input during the prefill takes the synth back right away
+            state.store(fallback ? REWIND : AHEAD, std::memory_order_release);
+        }
+    }
+
+    // Seconds rendered but not yet heard
+    double buffered() const {
+        return double(written.load() - readPos.load()) / sampleRate;
+    }
+
+   private:
+    size_t ringIndex(int channel, uint64_t frame) const {
+        return size_t(channel) * RING_FRAMES + (frame & (RING_FRAMES - 1));
+    }
+
+    void copyFromRing(int channel, uint64_t frame, float *out, int n) const {
+        // At most two contiguous runs around the end of the ring
+        int first = std::min(n, int(RING_FRAMES - (frame & (RING_FRAMES - 1))));
+        const float *src = &ring[ringIndex(channel, frame)];
+        std::copy(src, src + first, out);
+        std::copy(&ring[ringIndex(channel, 0)], &ring[ringIndex(channel, 0)] + (n - first),
+                  out + first);
+    }
+
+    // Renders one block into the ring. Called by whichever thread owns the
+    // synth.
+    void renderBlock() {
+        uint64_t w = written.load(std::memory_order_relaxed);
+        block.zeroOut();
+        block.frame(0);
+        render(block);
+        for (int c = 0; c < channels; c++) {
+            const float *in = block.outBuffer(c);
+            for (int i = 0; i < BLOCK_SIZE; i++)
+                ring[ringIndex(c, w + i)] = in[i];
+        }
+        noteVoiceOnsets(int64_t(w));
+        written.store(w + BLOCK_SIZE, std::memory_order_release);
+    }
+
+    // Audio thread, at the handoff. Renders the next callback into the ring
+    // right away, so the ring is not empty before the worker has woken up.
+    // The block io holds is set aside meanwhile, so this costs one more
+    // render of the callback's size. Larger callbacks are filled in whole
+    // blocks, which costs less than twice that.
+    void prefill(al::AudioIOData &io) {
+        int frames = io.framesPerBuffer();
+        if (frames > BLOCK_SIZE) {
+            for (int done = 0; done < frames; done += BLOCK_SIZE)
+                renderBlock();
+            return;
+        }
+
+        uint64_t w = written.load(std::memory_order_relaxed);
+        int outChannels = std::min(channels, int(io.channelsOut()));
+        for (int c = 0; c < outChannels; c++) {
+            float *out = io.outBuffer(c);
+            std::copy(out, out + frames, &scratch[size_t(c) * BLOCK_SIZE]);
+            std::fill(out, out + frames, 0.f);
+        }
+        io.frame(0);
+        render(io);
+        for (int c = 0; c < channels; c++) {
+            float *out = c < outChannels ? io.outBuffer(c) : nullptr;
+            for (int i = 0; i < frames; i++)
+                ring[ringIndex(c, w + i)] = out ? out[i] : 0.f;
+            if (out)
+                std::copy(&scratch[size_t(c) * BLOCK_SIZE],
+                          &scratch[size_t(c) * BLOCK_SIZE] + frames, out);
+        }
+        noteVoiceOnsets(int64_t(w));
+        written.store(w + frames, std::memory_order_release);
+    }
+
+    // The functions below touch the voices, whichever thread owns the synth.
+    // Voices are recycled, so the id tells a live voice from a sequence voice
+    // that took over the same object.
+    void noteLiveVoices() {
+        numLiveVoices = 0;
+        for (al::SynthVoice *v = synth->getActiveVoices(); v; v = v->next) {
+            if (numLiveVoices == MAX_LIVE_VOICES)
+                break;
+            liveVoices[numLiveVoices++] = {v, v->id()};
+        }
+    }
+
+    bool isLiveVoice(al::SynthVoice *voice) {
+        for (int i = 0; i < numLiveVoices; i++)
+            if (liveVoices[i].voice == voice && liveVoices[i].id == voice->id())
+                return true;
+        return false;
+    }
+
+    bool sequenceVoicesActive() {
+        for (al::SynthVoice *v = synth->getActiveVoices(); v; v = v->next)
+            if (!isLiveVoice(v))
+                return true;
+        return false;
+    }
+
+    // Keeps the ring frame of the block each sequence voice started in,
+    // after that block was rendered at blockStart
+    void noteVoiceOnsets(int64_t blockStart) {
+        SequenceVoice next[MAX_SEQUENCE_VOICES];
+        int count = 0;
+        for (al::SynthVoice *v = synth->getActiveVoices(); v; v = v->next) {
+            if (count == MAX_SEQUENCE_VOICES)
+                break;
+            if (isLiveVoice(v))
+                continue;
+            next[count] = {v, v->id(), voiceOnset(v, blockStart)};
+            count++;
+        }
+        std::copy(next, next + count, sequenceVoices);
+        numSequenceVoices = count;
+    }
+
+    int64_t voiceOnset(al::SynthVoice *voice, int64_t unknown) {
+        for (int i = 0; i < numSequenceVoices; i++)
+            if (sequenceVoices[i].voice == voice && sequenceVoices[i].id == voice->id())
+                return sequenceVoices[i].onset;
+        return unknown;
+    }
+
+    // Sequence voices the worker started at or after the audible frame were
+    // never heard and are dropped, the ones already sounding are released
+    void stopSequenceVoices(uint64_t audible) {
+        for (al::SynthVoice *v = synth->getActiveVoices(); v; v = v->next) {
+            if (isLiveVoice(v))
+                continue;
+            if (voiceOnset(v, -1) >= int64_t(audible))
+                v->free();
+            else
+                v->triggerOff();
+        }
+    }
+
+    void applyLiveTriggers() {
+        std::function<void()> trigger;
+        while (liveTriggers.pop(trigger))
+            trigger();
+    }
+
+    void run() {
+        while (running) {
+            if (state.load(std::memory_order_acquire) != AHEAD) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                continue;
+            }
+            if (fallback || !enabled) {
+                fallback = true;
+                state.store(REWIND, std::memory_order_release);
+                continue;
+            }
+
+            uint64_t w = written.load(std::memory_order_relaxed);
+            uint64_t lead = std::min<uint64_t>(uint64_t(leadSeconds.load() * sampleRate),
+                                               RING_FRAMES - BLOCK_SIZE);
+            if (w - readPos.load(std::memory_order_acquire) + BLOCK_SIZE > lead) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
+            }
+
+            renderBlock();
+
+            // Once the sequence is over keep going until the voices it
+            // started have died away, then let the audio thread play out the
+            // ring and take over
+            if (ended.exchange(false))
+                tail = true;
+            if (tail && !sequenceVoicesActive())
+                state.store(DRAIN, std::memory_order_release);
+        }
+    }
+
+    double sampleRate = 44100.0;
+    int channels = 2;
+    al::PolySynth *synth = nullptr;
+    std::function<void(al::AudioIOData &)> render;
+
+    std::atomic<bool> running{false};
+    std::thread worker;
+
+    std::atomic<bool> pending{false};
+    std::atomic<bool> ended{false};
+    std::atomic<bool> fallback{false};
+    std::atomic<float> sequenceTime{0.f};
+    bool tail = false;    // worker
+    bool fading = false;  // audio thread
+    bool mixing = false;  // audio thread
+    bool takenBack = false;  // audio thread
+
+    // Written by the audio thread while LIVE, read by the worker after the
+    // handoff
+    struct LiveVoice {
+        al::SynthVoice *voice;
+        int id;
+    };
+    LiveVoice liveVoices[MAX_LIVE_VOICES];
+    int numLiveVoices = 0;
+    SpscQueue<std::function<void()>, 256> liveTriggers;
+
+    // Written by whichever thread owns the synth. onset is the ring frame of
+    // the block the voice started in, -1 when it sounded before the ring.
+    struct SequenceVoice {
+        al::SynthVoice *voice;
+        int id;
+        int64_t onset;
+    };
+    SequenceVoice sequenceVoices[MAX_SEQUENCE_VOICES];
+    int numSequenceVoices = 0;
+
+    std::vector<float> ring;
+    std::vector<float> scratch;  // the live block, set aside during prefill()
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> readPos{0};
+    al::AudioIOData block;
+};
+
+// Enable, lead and status of a RenderAhead, drawn into the current ImGui
+// window.
+inline void drawRenderAheadControls(RenderAhead &renderAhead) {
+    const char *stateNames[] = {"live",      "ahead",       "draining",
+                                "rewinding", "handing off", "live input"};
+    bool enabled = renderAhead.enabled;
+    if (ImGui::Checkbox("Render sequences ahead", &enabled)) {
+        renderAhead.enabled = enabled;
+    }
+    float lead = renderAhead.leadSeconds;
+    if (ImGui::SliderFloat("Lead", &lead, 0.1f, 4.f, "%.1f s")) {
+        renderAhead.leadSeconds = lead;
+    }
+    ImGui::Text("Playback: %s, %.2f s buffered", stateNames[renderAhead.state.load()],
+                renderAhead.buffered());
+    ImGui::Text("%d underruns, %d fallbacks to live", renderAhead.underruns.load(),
+                renderAhead.fallbacks.load());
+}
+
+// Decides which frames have to be built and drawn. Input, MIDI and GUI
+// interaction mark the scheduler dirty from any thread. While nothing is
+// dirty the ImGui frame is only rebuilt at idleRate, and the scene is only
+// rendered while it changes. The apps render the scene into an offscreen
+// buffer that is shown every frame, so a frame without a render shows the
+// last scene again rather than an undefined back buffer.
+class RedrawScheduler {
+   public:
+    bool enabled = true;   // off rebuilds and draws every frame
+    float idleRate = 5.f;  // GUI rebuilds per second while idle
+
+    uint64_t framesDrawn = 0;
+    uint64_t framesSkipped = 0;
+
+    // Any thread
+    void markDirty() { dirty.store(true, std::memory_order_relaxed); }
+
+    // Graphics thread, once per frame before the GUI is built. animating
+    // tells whether the scene itself is moving. Returns true when the GUI
+    // should be rebuilt this frame.
+    bool beginFrame(double dt, bool animating) {
+        bool changed = dirty.exchange(false, std::memory_order_relaxed);
+        sinceGui += dt;
+        bool gui = !enabled || changed || sinceGui >= 1.0 / idleRate;
+        if (gui)
+            sinceGui = 0.0;
+        draw = !enabled || changed || animating;
+        if (draw)
+            framesDrawn++;
+        else
+            framesSkipped++;
+        return gui;
+    }
+
+    // Graphics thread, false when the offscreen scene is still current
+    bool shouldDraw() const { return draw; }
+
+   private:
+    std::atomic<bool> dirty{true};
+    double sinceGui = 0.0;
+    bool draw = true;
+};
+
+// Redraw toggle, idle rate and the share of frames rendered, drawn into the
+// current ImGui window.
+inline void drawRedrawControls(RedrawScheduler &redraw) {
+    ImGui::Checkbox("Redraw on change only", &redraw.enabled);
+    ImGui::SliderFloat("Idle GUI rate", &redraw.idleRate, 1.f, 60.f, "%.0f Hz");
+    uint64_t total = redraw.framesDrawn + redraw.framesSkipped;
+    ImGui::Text("Scene rendered in %.0f%% of frames",
+                total ? 100.0 * redraw.framesDrawn / total : 100.0);
+}
+
+#endif  // SYNTH_COMMON_HPP
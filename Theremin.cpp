@@ -1,4 +1,15 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>  // for printing to stdout
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
 
 // http://www.thereminworld.com/Forums/T/32167/theremin-like-sound-synthesis
 
@@ -9,6 +20,7 @@
 #include "Gamma/Filter.h"
 #include "Gamma/Oscillator.h"
 #include "al/app/al_App.hpp"
+#include "al/graphics/al_EasyFBO.hpp"
 #include "al/graphics/al_Font.hpp"
 #include "al/graphics/al_Shapes.hpp"
 #include "al/io/al_MIDI.hpp"
@@ -17,6 +29,9 @@
 #include "al/ui/al_ControlGUI.hpp"
 #include "al/ui/al_Parameter.hpp"
 
+#include "SynthCommon.hpp"
+#include "Theremin.hpp"
+
 // using namespace gam;
 using namespace al;
 
@@ -49,149 +64,13 @@ float lerp(float a, float b, float t) {
     return a + (b - a) * t;
 }
 
-class Theremin : public SynthVoice {
-   public:
-    // Unit generators
-    gam::Pan<> mPan;
-
-    gam::Saw<> mOsc;
-    gam::Sine<> mOsc2;
-
-    gam::Env<3> mAmpEnv;
-
-    // Vibrato
-    gam::Sine<> mVib;
-    gam::ADSR<> mVibEnv;
-
-    gam::OnePole<> lpf;
-    gam::OnePole<> hpf;
-
-    float vibValue;
-
-    // envelope follower to connect audio output to graphics
-    gam::EnvFollow<> mEnvFollow;
-
-    Mesh mMesh;
-
-    // Initialize voice. This function will only be called once per voice when
-    // it is created. Voices will be reused if they are idle.
-    void
-    init() override {
-        // Intialize envelope
-        mAmpEnv.curve(0);  // make segments lines
-        mAmpEnv.levels(0, 1, 1, 0);
-        mAmpEnv.sustainPoint(
-            2);  // Make point 2 sustain until a release is issued
-
-        mVibEnv.curve(0);
-
-        lpf.type(gam::LOW_PASS);
-        lpf.freq(1800);
-
-        hpf.type(gam::SMOOTHING);
-        hpf.freq(4000);
-
-        addRect(mMesh, 1, 1, 0.5, 0.5);
-        // This is a quick way to create parameters for the voice. Trigger
-        // parameters are meant to be set only when the voice starts, i.e. they
-        // are expected to be constant within a voice instance. (You can
-        // actually change them while you are prototyping, but their changes
-        // will only be stored and aplied when a note is triggered.)
-
-        createInternalTriggerParameter("amplitude", 0.3, 0.0, 1.0);
-        createInternalTriggerParameter("baseAmplitude", 0.3, 0.0, 1.0);
-
-        createInternalTriggerParameter("frequency", 60, 20, 5000);
-        createInternalTriggerParameter("targetFrequency", 60, 20, 5000);
-        createInternalTriggerParameter("attackTime", 0.01, 0.01, 3.0);
-        createInternalTriggerParameter("releaseTime", 0.1, 0.1, 10.0);
-        createInternalTriggerParameter("pan", 0.0, -1.0, 1.0);
-
-        createInternalTriggerParameter("vibRate1", 3.5, 0.2, 20);
-        createInternalTriggerParameter("vibRate2", 8, 0.2, 20);
-        createInternalTriggerParameter("vibRise", 0.5, 0.1, 2);
-        createInternalTriggerParameter("vibDepth", 0.005, 0.0, 0.3);
-
-        createInternalTriggerParameter("lowPassFilter", 800, 0, 44000);
-        createInternalTriggerParameter("highPassFilter", 900, 0, 44000);
-    }
-
-    // The audio processing function
-    void
-    onProcess(AudioIOData &io) override {
-        // Get the values from the parameters and apply them to the
-        // corresponding unit generators. You could place these lines in the
-        // onTrigger() function, but placing them here allows for realtime
-        // prototyping on a running voice, rather than having to trigger a new
-        // voice to hear the changes. Parameters will update values once per
-        // audio callback because they are outside the sample processing loop.
-        float oscFreq = getInternalParameterValue("frequency");
-
-        float vibDepth = getInternalParameterValue("vibDepth");
-        mAmpEnv.lengths()[0] = getInternalParameterValue("attackTime");
-        mAmpEnv.lengths()[2] = getInternalParameterValue("releaseTime");
-
-        lpf.freq(getInternalParameter("lowPassFilter"));
-        hpf.freq(getInternalParameter("highPassFilter"));
-
-        mPan.pos(getInternalParameterValue("pan"));
-        while (io()) {
-            mVib.freq(mVibEnv());
-            vibValue = mVib();
-            mOsc.freq(oscFreq + vibValue * vibDepth * oscFreq);
-            mOsc2.freq(oscFreq + 3 + vibValue * vibDepth * oscFreq);
-
-            float s1 = (mOsc() + mOsc2()) / 2 * mAmpEnv() * getInternalParameterValue("amplitude");
-
-            s1 = hpf(lpf(s1));
-            float s2;
-            mEnvFollow(s1);
-            mPan(s1, s1, s2);
-            io.out(0) += s1;
-            io.out(1) += s2;
-        }
-        // We need to let the synth know that this voice is done
-        // by calling the free(). This takes the voice out of the
-        // rendering chain
-        if (mAmpEnv.done() && (mEnvFollow.value() < 0.001f))
-            free();
-    }
-
-    // The graphics processing function
-    void
-    onProcess(Graphics &g) override {
-    }
-
-    // The triggering functions just need to tell the envelope to start or
-    // release The audio processing function checks when the envelope is done
-    // to remove the voice from the processing chain.
-    void
-    onTriggerOn() override {
-        mAmpEnv.reset();
-        mVibEnv.reset();
-
-        mVibEnv.levels(getInternalParameterValue("vibRate1"),
-            getInternalParameterValue("vibRate2"),
-            getInternalParameterValue("vibRate2"),
-            getInternalParameterValue("vibRate1"));
-
-        /*
-        mVibEnv.lengths()[0] = getInternalParameterValue("vibRise");
-        mVibEnv.lengths()[1] = getInternalParameterValue("vibRise");
-        mVibEnv.lengths()[3] = getInternalParameterValue("vibRise");
-        */
-    }
-
-    void
-    onTriggerOff() override {
-        mAmpEnv.release();
-    }
-};
 
 struct CallbackData {
     Theremin *instrument;
     bool *mousePlay;
     float* timeSinceLastNote;
+    RedrawScheduler *redraw;
+    RenderAhead *renderAhead;
 };
 
 void midiCallback(double deltaTime, std::vector<unsigned char> *msg, void *userData) {
@@ -205,6 +84,7 @@ void midiCallback(double deltaTime, std::vector<unsigned char> *msg, void *userD
         Theremin *instrument = data->instrument;
         bool *mousePlay = data->mousePlay;
         float* timeSinceLastNote = data->timeSinceLastNote;
+        data->redraw->markDirty();
 
         printf("%s: ", MIDIByte::messageTypeString(status));
 
@@ -217,6 +97,7 @@ void midiCallback(double deltaTime, std::vector<unsigned char> *msg, void *userD
             switch (type) {
                 case MIDIByte::NOTE_ON:
                     // printf("Note %u, Vel %u \n", msg->at(1), msg->at(2));
+                    data->renderAhead->liveInput();
                     *mousePlay = false;
                     if (*timeSinceLastNote > 0.6f){
                         *timeSinceLastNote = 0;
@@ -268,6 +149,9 @@ class MyApp : public App {
     FontRenderer fontRender;
     int fontSize = 16;
 
+    // MIDI port setup, also run on a worker thread
+    std::future<void> midiReady;
+
     bool mousePlay = true;
 
     float timeSinceLastNote = 0;
@@ -306,6 +190,28 @@ class MyApp : public App {
 
     RtMidiIn RtMidiIn;
 
+    CallbackLoadMeter loadMeter;
+    AdaptiveBufferSize adaptiveBuffer;
+    // Opt in from the GUI, each change reopens the device, which is audible
+    bool adaptiveLatency = false;
+
+    ProfilerPanel profilerPanel;
+
+    SpectrumAnalyzer analyzer;
+    SpectrumAnalyzer::Frame analyzerFrame;
+
+    RedrawScheduler redraw;
+    // Last rendered scene, shown again on frames that skip the render
+    EasyFBO sceneFbo;
+    int sceneWidth = 0, sceneHeight = 0;
+    // What the rendered scene shows, see sceneMoves()
+    float shownFrequency = -1.f;
+    float shownAmplitude = -1.f;
+    float shownLevel = -1.f;
+    SpectrumAnalyzer::Frame shownFrame;
+
+    RenderAhead renderAhead;
+
     void onCreate() override {
         navControl().active(
             false);  // Disable navigation via keyboard, since we
@@ -314,10 +220,21 @@ class MyApp : public App {
         // Set sampling rate for Gamma objects from app's audio
         gam::sampleRate(audioIO().framesPerSecond());
 
-        imguiInit();
+        // Calibrate the profiler clock before the first block is timed
+        VoiceProfiler::instance().ticksPerSecond();
 
         instrument = synthManager.voice();
 
+        // Opening MIDI ports can be slow, do it alongside the GUI setup
+        midiReady = std::async(std::launch::async, [this]() { openMidi(); });
+
+        imguiInit();
+
+        analyzer.start(audioIO().framesPerSecond());
+
+        // Sequence playback is rendered ahead on a worker thread
+        renderAhead.start(audioIO().framesPerSecond(), audioIO().channelsOut(), synthManager);
+
         synthManager.triggerOn();
 
         // Set the font renderer
@@ -325,7 +242,9 @@ class MyApp : public App {
 
         // Play example sequence. Comment this line to start from scratch
         synthManager.synthRecorder().verbose(true);
+    }
 
+    void openMidi() {
         // Check available ports vs. specified
         unsigned portToOpen = 0;
         unsigned numPorts = RtMidiIn.getPortCount();
@@ -354,6 +273,8 @@ class MyApp : public App {
         cbd->instrument = instrument;
         cbd->mousePlay = &mousePlay;
         cbd->timeSinceLastNote = &timeSinceLastNote;
+        cbd->redraw = &redraw;
+        cbd->renderAhead = &renderAhead;
         RtMidiIn.setCallback(&midiCallback, cbd);  //&synthManager
 
         // Don't ignore sysex, timing, or active sensing messages.
@@ -362,15 +283,48 @@ class MyApp : public App {
 
     // The audio callback function. Called when audio hardware requires data
     void onSound(AudioIOData &io) override {
-        synthManager.render(io);  // Render audio
+        loadMeter.begin();
+        // Copy sequence playback rendered ahead, or render live when this
+        // thread owns the synth
+        double rewindTo;
+        if (!renderAhead.read(io, rewindTo)) {
+            // The held instrument voice is live, only the sequence's
+            // voices are released by the rewind
+            if (rewindTo >= 0.0)
+                synthManager.synthSequencer().setTime(float(rewindTo));
+            synthManager.render(io);  // Render audio
+            renderAhead.afterLive(io);
+        }
+        loadMeter.end(io.framesPerBuffer(), io.framesPerSecond());
+        analyzer.write(io);
     }
 
     void onAnimate(double dt) override {
-        // The GUI is prepared here
-        imguiBeginFrame();
-        // Draw a window that contains the synth control panel
-        synthManager.drawSynthControlPanel();
-        imguiEndFrame();
+        profilerPanel.drainTrace();
+
+        analyzer.latest(analyzerFrame);
+        bool animating = sceneMoves();
+
+        // The GUI is prepared here, at a reduced rate while nothing changes
+        if (redraw.beginFrame(dt, animating)) {
+            imguiBeginFrame();
+            // Draw a window that contains the synth control panel
+            synthManager.drawSynthControlPanel();
+            drawAudioLoadPanel();
+            profilerPanel.draw(1e6 * audioIO().framesPerBuffer() / audioIO().framesPerSecond());
+            imguiEndFrame();
+            // Keep full rate while a widget is being dragged or edited
+            if (ImGui::IsAnyItemActive()) {
+                redraw.markDirty();
+            }
+        }
+
+        if (adaptiveLatency) {
+            unsigned size = adaptiveBuffer.update(dt, loadMeter, audioIO().framesPerBuffer());
+            if (size > 0) {
+                setBufferSize(audioIO(), loadMeter, size);
+            }
+        }
 
         timer += dt;
         timeSinceLastNote += dt;
@@ -420,6 +374,10 @@ class MyApp : public App {
         // std::cout << "pos: " << x << ", " << y << std::endl;
 
         mousePlay = true;
+        redraw.markDirty();
+        // Playing the theremin by hand, not just reaching for the GUI
+        if (!ImGui::GetIO().WantCaptureMouse)
+            renderAhead.liveInput();
         instrument->setInternalParameterValue("amplitude", clamp((float)(height() - (y + 50)) / (height() * 0.8f), 0, 1));
         instrument->setInternalParameterValue("abseAmpltidue", instrument->getInternalParameter("amplitude"));
         // instrument->triggerOn();
@@ -429,26 +387,49 @@ class MyApp : public App {
 
     // The graphics callback function.
     void onDraw(Graphics &g) override {
-        g.clear();
+        bool resized = sceneWidth != fbWidth() || sceneHeight != fbHeight();
+        if (resized) {
+            sceneWidth = fbWidth();
+            sceneHeight = fbHeight();
+            sceneFbo.init(sceneWidth, sceneHeight);
+        }
 
-        // This example uses only the orthogonal projection for 2D drawing
-        g.camera(Viewpoint::ORTHO_FOR_2D);  // Ortho [0:width] x [0:height]
+        // Render the scene offscreen only when it changed
+        if (resized || redraw.shouldDraw()) {
+            g.pushFramebuffer(sceneFbo);
+            g.clear();
 
-        // Render the synth's graphics
-        synthManager.render(g);
+            // This example uses only the orthogonal projection for 2D drawing
+            g.camera(Viewpoint::ORTHO_FOR_2D);  // Ortho [0:width] x [0:height]
 
-        drawRect(g, 0, 50, width(), 2);
+            drawAnalyzer(g);
 
-        for (int i = 0; i < notes.size(); i++) {
-            drawRect(g, notes[i].freq - 400, 70, 2, 40);
-        }
-        drawRect(g, instrument->getInternalParameter("frequency") - 400, instrument->getInternalParameter("amplitude") * height() * 0.8 + 50, 4, 4);
+            // Render the synth's graphics
+            synthManager.render(g);
 
-        // For some reason rects won't draw after prints?
-        for (int i = 0; i < notes.size(); i++) {
-            print(g, notes[i].note, notes[i].freq - 8 - 400, 15);
+            drawRect(g, 0, 50, width(), 2);
+
+            for (int i = 0; i < notes.size(); i++) {
+                drawRect(g, notes[i].freq - 400, 70, 2, 40);
+            }
+            drawRect(g, instrument->getInternalParameter("frequency") - 400, instrument->getInternalParameter("amplitude") * height() * 0.8 + 50, 4, 4);
+
+            // For some reason rects won't draw after prints?
+            for (int i = 0; i < notes.size(); i++) {
+                print(g, notes[i].note, notes[i].freq - 8 - 400, 15);
+            }
+            g.popFramebuffer();
+
+            shownFrequency = instrument->getInternalParameter("frequency");
+            shownAmplitude = instrument->getInternalParameter("amplitude");
+            shownLevel = instrument->mEnvFollow.value();
+            shownFrame = analyzerFrame;
         }
 
+        // Show the scene every frame, the back buffer is undefined after a swap
+        g.blending(false);
+        g.quadViewport(sceneFbo.tex());
+
         // GUI is drawn here
         imguiDraw();
     }
@@ -460,18 +441,21 @@ class MyApp : public App {
             return true;
         }
 
+        redraw.markDirty();
+
         // Control lpf and hpf
         int button = k.key();
         std::cout << button << std::endl;
 
-        if (button == 49) {  // 1
-            instrument->setInternalParameterValue("lowPassFilter", instrument->getInternalParameter("lowPassFilter") - 100);
-        } else if (button == 50) {
-            instrument->setInternalParameterValue("lowPassFilter", instrument->getInternalParameter("lowPassFilter") + 100);
-        } else if (button == 51) {  // 3
-            instrument->setInternalParameterValue("highPassFilter", instrument->getInternalParameter("highPassFilter") - 100);
-        } else if (button == 52) {
-            instrument->setInternalParameterValue("highPassFilter", instrument->getInternalParameter("highPassFilter") + 100);
+        // 1 and 2 lower and raise the lpf, 3 and 4 the hpf. The change is
+        // heard at once, so it is live input like a played note.
+        if (button >= 49 && button <= 52) {
+            const char *filter = button <= 50 ? "lowPassFilter" : "highPassFilter";
+            float step = button % 2 ? -100.f : 100.f;
+            Theremin *voice = instrument;
+            renderAhead.liveInput([voice, filter, step]() {
+                voice->setInternalParameterValue(filter, voice->getInternalParameter(filter) + step);
+            });
         }
 
         return true;
@@ -486,12 +470,102 @@ class MyApp : public App {
     // Whenever the window size changes this function is called
     void
     onResize(int w, int h) override {
+        redraw.markDirty();
     }
 
     void onExit() override {
+        if (midiReady.valid())
+            midiReady.wait();
+        renderAhead.stop();
+        analyzer.stop();
         imguiShutdown();
     }
 
+    // Spectrum bars hanging from the top edge with the oscilloscope below them
+    void drawAnalyzer(Graphics &g) {
+        float w = float(width());
+        float h = float(height());
+
+        g.blending(true);
+        g.blendTrans();
+
+        Mesh bars;
+        bars.primitive(Mesh::TRIANGLES);
+        float bandWidth = w / SpectrumAnalyzer::NUM_BANDS;
+        for (int b = 0; b < SpectrumAnalyzer::NUM_BANDS; b++) {
+            float x0 = b * bandWidth, x1 = x0 + bandWidth - 1;
+            float y0 = h - analyzerFrame.bands[b] * h * 0.2f;
+            bars.vertex(x0, h);
+            bars.vertex(x1, h);
+            bars.vertex(x1, y0);
+            bars.vertex(x0, h);
+            bars.vertex(x1, y0);
+            bars.vertex(x0, y0);
+        }
+        g.color(0.3, 0.6, 1.0, 0.5);
+        g.draw(bars);
+
+        Mesh scope;
+        scope.primitive(Mesh::LINE_STRIP);
+        for (int i = 0; i < SpectrumAnalyzer::SCOPE_SIZE; i++) {
+            float x = i * w / (SpectrumAnalyzer::SCOPE_SIZE - 1);
+            scope.vertex(x, h * 0.7f + analyzerFrame.scope[i] * h * 0.05f);
+        }
+        g.color(0.6, 1.0, 0.6, 0.7);
+        g.draw(scope);
+    }
+
+    // The drone voice always sounds, so the scene counts as moving only while
+    // something in it would move by at least a pixel: the pitch cursor, the
+    // voice's level bar, a spectrum bar or the triggered scope. A steady tone
+    // or silence with the mouse at rest draws nothing new.
+    bool sceneMoves() {
+        float h = float(height());
+        float frequency = instrument->getInternalParameter("frequency");
+        float amplitude = instrument->getInternalParameter("amplitude");
+        float level = instrument->mEnvFollow.value();
+        if (std::fabs(frequency - shownFrequency) >= 1.f ||
+            std::fabs(amplitude - shownAmplitude) * h * 0.8f >= 1.f ||
+            std::fabs(level - shownLevel) * 400.f >= 1.f)
+            return true;
+        for (int b = 0; b < SpectrumAnalyzer::NUM_BANDS; b++) {
+            if (std::fabs(analyzerFrame.bands[b] - shownFrame.bands[b]) * h * 0.2f >= 1.f)
+                return true;
+        }
+        for (int i = 0; i < SpectrumAnalyzer::SCOPE_SIZE; i++) {
+            if (std::fabs(analyzerFrame.scope[i] - shownFrame.scope[i]) * h * 0.05f >= 1.f)
+                return true;
+        }
+        return false;
+    }
+
+    bool onMouseDown(const Mouse &m) override {
+        redraw.markDirty();
+        return true;
+    }
+
+    bool onMouseUp(const Mouse &m) override {
+        redraw.markDirty();
+        return true;
+    }
+
+    bool onMouseDrag(const Mouse &m) override {
+        redraw.markDirty();
+        return true;
+    }
+
+    void drawAudioLoadPanel() {
+        ImGui::Begin("Audio load");
+        drawAudioLoadControls(audioIO(), loadMeter, adaptiveBuffer, adaptiveLatency);
+
+        ImGui::Separator();
+        drawRenderAheadControls(renderAhead);
+
+        ImGui::Separator();
+        drawRedrawControls(redraw);
+        ImGui::End();
+    }
+
     void drawRect(Graphics &g, int x, int y, int width, int height) {
         g.tint(1, 1, 1);
         Mesh mesh;
@@ -509,15 +583,19 @@ class MyApp : public App {
     }
 };
 
-int main() {
+int main(int argc, char *argv[]) {
+    // Speaker layout, e.g. --channels=8 --panner=dbap for an 8 speaker ring
+    int channels = parseSpatialArgs(argc, argv);
+
     // Create app instance
     MyApp app;
 
     // Set window size
     app.dimensions(1200, 600);
 
-    // Set up audio
-    app.configureAudio(48000., 512, 2, 0);
+    // Set up audio. The buffer size is only the starting point when the
+    // adaptive buffer size is enabled.
+    app.configureAudio(48000., 512, channels, 0);
     app.start();
     return 0;
 }